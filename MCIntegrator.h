@@ -1,63 +1,727 @@
 #pragma once
 
+#include <span>
+#include <array>
 #include <vector>
 #include <numeric>
 #include <random>
+#include <mutex>
 #include <thread>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include <cassert>
+#include <type_traits>
 
 #include "pcg-cpp/include/pcg_random.hpp"
 #include "functional_helpers.hpp"
+#include "rng.h"
+#include "sobol.h"
+#include "stoppingRule.h"
+#include "reduction.h"
+#include "threadPool.h"
 
 namespace S = std;
 
-template<typename T, typename V>
-void addVectorsInPlace(S::vector<T> &result, const S::vector<V> &v) {
+template<typename R, typename V>
+void addVectorsInPlace(R &result, const V &v) {
     S::transform(v.begin(), v.end(), result.begin(), result.begin(), S::plus<>());
 };
 
 typedef void GENERATOR(const S::vector<float> &, S::vector<float> &);
 
-struct Sampler {
-    pcg32 rng{pcg_extras::seed_seq_from<std::random_device>{} };
-    S::uniform_real_distribution<> dist{0.0, 1.0};
+template<typename RNG = Pcg32Uniforms>
+struct BasicSampler {
+    RNG rng{pcg_extras::seed_seq_from<std::random_device>{} };
 
-    inline float next() { return dist(rng); }
+    inline float next() { return rng.next(); }
 
-    inline void fill(S::vector<float> &s) { for(auto& el : s) el = dist(rng); }
+    inline void fill(S::vector<float> &s) { rng.fill(s.data(), s.size()); }
+
+    inline void fill(S::vector<uint32_t> &s) { rng.fill(s.data(), s.size()); }
+
+    inline void fill(float *s, size_t count) { rng.fill(s, count); }
+};
+
+using Sampler = BasicSampler<>;
+using LaneSampler = BasicSampler<PcgLanes<16>>;
+
+inline LaneSampler &threadSampler() {
+    thread_local auto s = LaneSampler();
+    return s;
+}
+
+// Dimension template argument for sizes only known at run time.
+constexpr size_t dynamicDimension{0};
+
+// Integrand input and output: S::array<T, N> when N is fixed at compile time, S::vector<T> otherwise.
+template<typename T, size_t N>
+using Buffer = S::conditional_t<N == dynamicDimension, S::vector<T>, S::array<T, N>>;
+
+template<typename T, size_t N>
+Buffer<T, N> makeBuffer(size_t size) {
+    if constexpr (N == dynamicDimension) return S::vector<T>(size);
+    else return Buffer<T, N>{};
+}
+
+template<typename C>
+C averaged(C sums, size_t samples) {
+    for (auto &v : sums) v /= samples;
+    return sums;
+}
+
+template<size_t OUT>
+Buffer<double, OUT> valuesOf(const Buffer<CompensatedSum, OUT> &sums) {
+    auto res = makeBuffer<double, OUT>(sums.size());
+    for (size_t k{0}; k < sums.size(); k++) res[k] = sums[k].value();
+    return res;
+}
+
+// Element-wise compensated total of a sequence of output sums.
+template<size_t OUT, typename Parts>
+Buffer<double, OUT> compensatedTotal(const Parts &parts, size_t out_dimension) {
+    auto sums = makeBuffer<CompensatedSum, OUT>(out_dimension);
+    for (const auto &part : parts) addCompensated(sums, part);
+    return valuesOf<OUT>(sums);
+}
+
+// Samples the single-threaded integrator sums plainly between flushes into the compensated total.
+constexpr size_t flushInterval{1 << 12};
+
+// Scratch of one integration: the integrand's input and output, the plain sum of the current chunk and the
+// compensated total of the flushed ones.
+template<size_t IN, size_t OUT>
+struct IntegrationBuffers {
+    Buffer<float, IN> input;
+    Buffer<float, OUT> sample;
+    Buffer<double, OUT> sum;
+    Buffer<CompensatedSum, OUT> total;
+
+    IntegrationBuffers() = default;
+
+    IntegrationBuffers(size_t in_dimension, size_t out_dimension) :
+            input(makeBuffer<float, IN>(in_dimension)),
+            sample(makeBuffer<float, OUT>(out_dimension)),
+            sum(makeBuffer<double, OUT>(out_dimension)),
+            total(makeBuffer<CompensatedSum, OUT>(out_dimension)) {}
+
+    // Sizes the buffers for a new run and clears the sums; only allocates when the dimensions grow.
+    void prepare(size_t in_dimension, size_t out_dimension) {
+        if constexpr (IN == dynamicDimension) resizePadded(input, in_dimension);
+        if constexpr (OUT == dynamicDimension) {
+            resizePadded(sample, out_dimension);
+            resizePadded(sum, out_dimension);
+            resizePadded(total, out_dimension);
+        }
+        S::fill(sum.begin(), sum.end(), 0.0);
+        S::fill(total.begin(), total.end(), CompensatedSum{});
+    }
+
+    void flush() {
+        addCompensated(total, sum);
+        S::fill(sum.begin(), sum.end(), 0.0);
+    }
+
+    [[nodiscard]] Buffer<double, OUT> totals() {
+        flush();
+        return valuesOf<OUT>(total);
+    }
 };
 
+// Adds the integrand's outputs for samples [first, last) to b.sum; fill(i, input) provides the i-th input.
+template<size_t IN, size_t OUT, typename Integrand, typename Fill>
+inline void integrateInto(IntegrationBuffers<IN, OUT> &b, size_t first, size_t last, Integrand &integrand,
+                          Fill &&fill) {
+    for (auto i{first}; i < last; i++) {
+        fill(i, b.input);
+        S::fill(b.sample.begin(), b.sample.end(), 0.0f);
+        integrand(b.input, b.sample);
+        addVectorsInPlace(b.sum, b.sample);
+    }
+}
+
+// All the state of an integration run, reused by the next run on the same context; a context serves one run at
+// a time. Each worker prepares its own buffers on its first chunk of a run.
+template<size_t IN = dynamicDimension, size_t OUT = dynamicDimension, typename Buffers = IntegrationBuffers<IN, OUT>>
+struct IntegratorContext {
+    struct Worker {
+        Buffers buffers;
+        // Run the buffers were last prepared for.
+        size_t run{0};
+    };
+
+    S::vector<Padded<Worker>> workers;
+    // Plain sums of the seeded integrators' chunks, out_dimension per chunk.
+    S::vector<double> chunkSums;
+    Buffer<CompensatedSum, OUT> total{};
+    Buffer<double, OUT> result{};
+    size_t run{0};
+    size_t in_dimension{0};
+    size_t out_dimension{0};
+
+    void begin(size_t workerCount, size_t in, size_t out) {
+        run++;
+        if (workers.size() < workerCount) workers.resize(workerCount);
+        in_dimension = in;
+        out_dimension = out;
+        if constexpr (OUT == dynamicDimension) {
+            total.resize(out);
+            result.resize(out);
+        }
+        S::fill(total.begin(), total.end(), CompensatedSum{});
+    }
+
+    Buffers &local(size_t worker) {
+        auto &w{workers[worker].value};
+        if (w.run != run) {
+            w.buffers.prepare(in_dimension, out_dimension);
+            w.run = run;
+        }
+        return w.buffers;
+    }
+
+    // Adds the flushed totals of every worker that took part in this run.
+    void collectWorkers() {
+        for (auto &w : workers) if (w.value.run == run) addCompensated(total, w.value.buffers.total);
+    }
+
+    const Buffer<double, OUT> &finish(size_t samples) {
+        for (size_t k{0}; k < out_dimension; k++) result[k] = total[k].value() / samples;
+        return result;
+    }
+};
+
+// Free list of contexts for concurrent integrations: acquire() hands out an unused context, returned when its
+// lease is destroyed. Contexts keep the runs' state apart, but runs on one ThreadPool still take turns, the pool
+// serving one job at a time.
+template<size_t IN = dynamicDimension, size_t OUT = dynamicDimension>
+class IntegratorContextPool {
+    S::mutex lock;
+    S::vector<S::unique_ptr<IntegratorContext<IN, OUT>>> idle;
+
+    void release(S::unique_ptr<IntegratorContext<IN, OUT>> context) {
+        S::lock_guard<S::mutex> guard{lock};
+        idle.push_back(S::move(context));
+    }
+
+public:
+    class Lease {
+        IntegratorContextPool *pool;
+        S::unique_ptr<IntegratorContext<IN, OUT>> context;
+
+    public:
+        Lease(IntegratorContextPool *pool, S::unique_ptr<IntegratorContext<IN, OUT>> context) :
+                pool(pool), context(S::move(context)) {}
+
+        Lease(Lease &&) noexcept = default;
+
+        ~Lease() { if (context) pool->release(S::move(context)); }
+
+        IntegratorContext<IN, OUT> &operator*() const { return *context; }
+
+        IntegratorContext<IN, OUT> *operator->() const { return context.get(); }
+    };
+
+    Lease acquire() {
+        S::lock_guard<S::mutex> guard{lock};
+        if (idle.empty()) return {this, S::make_unique<IntegratorContext<IN, OUT>>()};
+        auto context{S::move(idle.back())};
+        idle.pop_back();
+        return {this, S::move(context)};
+    }
+};
+
+// integrand(const In &, Out &) may be any callable; In and Out are arrays when IN and OUT are given, vectors
+// otherwise. Overloads taking a context return a reference to its result, valid until the context's next run.
+template<size_t IN, size_t OUT, typename Integrand>
+const Buffer<double, OUT> &MCIntegrator(IntegratorContext<IN, OUT> &context, size_t samples, size_t in_dimension,
+                                        size_t out_dimension, Integrand &&integrand) {
+    auto &s{threadSampler()};
+    context.begin(1, in_dimension, out_dimension);
+    auto &b{context.local(0)};
+
+    for (size_t first{0}; first < samples; first += flushInterval) {
+        integrateInto(b, first, S::min(first + flushInterval, samples), integrand,
+                      [&](size_t, auto &input) { s.fill(input.data(), input.size()); });
+        b.flush();
+    }
+    context.collectWorkers();
+    return context.finish(samples);
+}
+
+template<size_t IN = dynamicDimension, size_t OUT = dynamicDimension, typename Integrand>
+auto MCIntegrator(size_t samples, size_t in_dimension, size_t out_dimension, Integrand &&integrand) {
+    auto context = IntegratorContext<IN, OUT>();
+    return MCIntegrator(context, samples, in_dimension, out_dimension, integrand);
+}
+
+template<size_t IN, size_t OUT, typename Integrand>
+auto MCIntegrator(size_t samples, Integrand &&integrand) {
+    return MCIntegrator<IN, OUT>(samples, IN, OUT, integrand);
+}
+
 auto MCIntegrator(size_t samples, size_t in_dimension, size_t out_dimension, GENERATOR generator) {
-    thread_local auto s = Sampler();
+    return MCIntegrator<>(samples, in_dimension, out_dimension, generator);
+}
+
+// Chunk size for the unseeded parallel integrator: enough chunks per worker for stealing to even out slow cores.
+inline size_t integrationChunk(size_t samples, size_t workers) {
+    return S::max(size_t{1} << 10, samples / (workers * 16));
+}
+
+template<size_t IN, size_t OUT, typename Integrand>
+const Buffer<double, OUT> &ParallelMCIntegrator(IntegratorContext<IN, OUT> &context, size_t samples,
+                                                size_t in_dimension, size_t out_dimension, Integrand &&integrand,
+                                                ThreadPool &pool = ThreadPool::global()) {
+    const auto chunk{integrationChunk(samples, pool.size())};
+    context.begin(pool.size(), in_dimension, out_dimension);
+
+    pool.parallelFor((samples + chunk - 1) / chunk, [&](size_t worker, size_t c) {
+        auto &s{threadSampler()};
+        auto &w{context.local(worker)};
+        integrateInto(w, c * chunk, S::min((c + 1) * chunk, samples), integrand,
+                      [&](size_t, auto &input) { s.fill(input.data(), input.size()); });
+        w.flush();
+    });
+
+    context.collectWorkers();
+    return context.finish(samples);
+}
+
+template<size_t IN = dynamicDimension, size_t OUT = dynamicDimension, typename Integrand>
+auto ParallelMCIntegrator(size_t samples, size_t in_dimension, size_t out_dimension, Integrand &&integrand,
+                          ThreadPool &pool = ThreadPool::global()) {
+    auto context = IntegratorContext<IN, OUT>();
+    return ParallelMCIntegrator(context, samples, in_dimension, out_dimension, integrand, pool);
+}
+
+template<size_t IN, size_t OUT, typename Integrand>
+auto ParallelMCIntegrator(size_t samples, Integrand &&integrand, ThreadPool &pool = ThreadPool::global()) {
+    return ParallelMCIntegrator<IN, OUT>(samples, IN, OUT, integrand, pool);
+}
 
-    thread_local auto input = S::vector<float>(in_dimension);
-    thread_local auto sample = S::vector<float>(out_dimension);
-    thread_local auto result = S::vector<double>(out_dimension);
+auto ParallelMCIntegrator(size_t samples, size_t in_dimension, size_t out_dimension, GENERATOR generator,
+                          ThreadPool &pool = ThreadPool::global()) {
+    return ParallelMCIntegrator<>(samples, in_dimension, out_dimension, generator, pool);
+}
+
+// Chunk of the seeded integrators, whose sums are added in chunk order so results do not depend on the pool.
+// The unseeded ParallelMCIntegrator adds each worker's total instead, and which chunks a worker ran depends on
+// stealing, so its rounding varies from run to run even apart from its draws.
+constexpr size_t reproducibleChunk{1 << 12};
+
+// s is any sampler addressed by sample index, such as CounterSampler or SobolSampler.
+template<size_t IN, size_t OUT, typename Integrand, typename Source>
+Buffer<double, OUT> integrateChunk(size_t first, size_t last, size_t in_dimension, size_t out_dimension,
+                                   Integrand &integrand, const Source &s) {
+    auto b = IntegrationBuffers<IN, OUT>(in_dimension, out_dimension);
+    integrateInto(b, first, last, integrand, [&](size_t i, auto &input) { s.fill(i, input.data(), input.size()); });
+    return b.totals();
+}
+
+template<size_t IN, size_t OUT, typename Integrand>
+const Buffer<double, OUT> &MCIntegrator(IntegratorContext<IN, OUT> &context, size_t samples, size_t in_dimension,
+                                        size_t out_dimension, Integrand &&integrand, uint64_t seed) {
+    const auto s{CounterSampler{seed}};
+    context.begin(1, in_dimension, out_dimension);
+    auto &b{context.local(0)};
+
+    for (size_t first{0}; first < samples; first += reproducibleChunk) {
+        integrateInto(b, first, S::min(first + reproducibleChunk, samples), integrand,
+                      [&](size_t i, auto &input) { s.fill(i, input.data(), input.size()); });
+        b.flush();
+    }
+    context.collectWorkers();
+    return context.finish(samples);
+}
+
+template<size_t IN = dynamicDimension, size_t OUT = dynamicDimension, typename Integrand>
+auto MCIntegrator(size_t samples, size_t in_dimension, size_t out_dimension, Integrand &&integrand, uint64_t seed) {
+    auto context = IntegratorContext<IN, OUT>();
+    return MCIntegrator(context, samples, in_dimension, out_dimension, integrand, seed);
+}
+
+template<size_t IN, size_t OUT, typename Integrand>
+const Buffer<double, OUT> &ParallelMCIntegrator(IntegratorContext<IN, OUT> &context, size_t samples,
+                                                size_t in_dimension, size_t out_dimension, Integrand &&integrand,
+                                                uint64_t seed, ThreadPool &pool = ThreadPool::global()) {
+    const auto s{CounterSampler{seed}};
+    const auto chunks{(samples + reproducibleChunk - 1) / reproducibleChunk};
+    context.begin(pool.size(), in_dimension, out_dimension);
+    context.chunkSums.resize(chunks * out_dimension);
+
+    pool.parallelFor(chunks, [&](size_t worker, size_t c) {
+        const auto first{c * reproducibleChunk};
+        auto &w{context.local(worker)};
+        integrateInto(w, first, S::min(first + reproducibleChunk, samples), integrand,
+                      [&](size_t i, auto &input) { s.fill(i, input.data(), input.size()); });
+        S::copy(w.sum.begin(), w.sum.end(), context.chunkSums.begin() + c * out_dimension);
+        S::fill(w.sum.begin(), w.sum.end(), 0.0);
+    });
+
+    for (size_t c{0}; c < chunks; c++)
+        for (size_t k{0}; k < out_dimension; k++) context.total[k].add(context.chunkSums[c * out_dimension + k]);
+    return context.finish(samples);
+}
+
+template<size_t IN = dynamicDimension, size_t OUT = dynamicDimension, typename Integrand>
+auto ParallelMCIntegrator(size_t samples, size_t in_dimension, size_t out_dimension, Integrand &&integrand,
+                          uint64_t seed, ThreadPool &pool = ThreadPool::global()) {
+    auto context = IntegratorContext<IN, OUT>();
+    return ParallelMCIntegrator(context, samples, in_dimension, out_dimension, integrand, seed, pool);
+}
+
+// Moments of the integrand's outputs over samples [first, last), reduced in a second pass over the outputs.
+template<size_t IN, size_t OUT, typename Integrand, typename Source>
+S::vector<RunningMoments> momentsChunk(size_t first, size_t last, size_t in_dimension, size_t out_dimension,
+                                       Integrand &integrand, const Source &s) {
+    auto b = IntegrationBuffers<IN, OUT>(in_dimension, out_dimension);
+    const auto n{last - first};
+    auto values = S::vector<float>(out_dimension * n);
+    for (auto i{first}; i < last; i++) {
+        s.fill(i, b.input.data(), b.input.size());
+        S::fill(b.sample.begin(), b.sample.end(), 0.0f);
+        integrand(b.input, b.sample);
+        // b.sample.size() rather than out_dimension: a compile-time bound when OUT is fixed.
+        for (size_t k{0}; k < b.sample.size(); k++) values[k * n + i - first] = b.sample[k];
+    }
 
-    for (size_t i{0}; i < samples; i++) {
-        s.fill(input);
-        generator(input, sample);
-        addVectorsInPlace(result, sample);
+    auto moments = S::vector<RunningMoments>(out_dimension);
+    for (size_t k{0}; k < out_dimension && n; k++) {
+        const auto column{values.data() + k * n};
+        const double shift{column[0]};
+        double sum{0}, sumSquares{0};
+        for (size_t i{0}; i < n; i++) {
+            const auto x{column[i] - shift};
+            sum += x;
+            sumSquares += x * x;
+        }
+        moments[k] = RunningMoments::fromShiftedSums(n, shift, sum, sumSquares);
     }
+    return moments;
+}
+
+// Seeded integration that stops once the confidence interval of every output meets rule, or at its cap; the
+// estimates and the number of samples depend on the seed alone.
+template<size_t IN = dynamicDimension, size_t OUT = dynamicDimension, typename Integrand>
+SequentialResult SequentialMCIntegrator(size_t in_dimension, size_t out_dimension, Integrand &&integrand,
+                                        const StoppingRule &rule, uint64_t seed,
+                                        ThreadPool &pool = ThreadPool::global()) {
+    const auto s{CounterSampler{seed}};
+    const auto z{rule.z()};
+    auto moments = S::vector<RunningMoments>(out_dimension);
+    S::vector<S::vector<RunningMoments>> chunkMoments;
+
+    const auto [samples, converged] = rule.run(rule.cap(0), [&](size_t first, size_t count) {
+        chunkMoments.assign((count + reproducibleChunk - 1) / reproducibleChunk, {});
+        pool.parallelFor(chunkMoments.size(), [&](size_t, size_t c) {
+            const auto begin{first + c * reproducibleChunk};
+            chunkMoments[c] = momentsChunk<IN, OUT>(begin, S::min(begin + reproducibleChunk, first + count),
+                                                    in_dimension, out_dimension, integrand, s);
+        });
+        for (const auto &chunk : chunkMoments)
+            for (size_t k{0}; k < out_dimension; k++) moments[k].merge(chunk[k]);
+    }, [&](size_t n) {
+        auto worst{0.0};
+        for (const auto &m : moments) worst = S::max(worst, rule.ratio(z * S::sqrt(m.variance() / n), m.mean));
+        return worst;
+    });
+
+    SequentialResult result{{}, {}, samples, converged};
+    for (const auto &m : moments) {
+        result.value.push_back(m.mean);
+        result.halfWidth.push_back(z * S::sqrt(m.variance() / samples));
+    }
+    return result;
+}
+
+struct RqmcResult {
+    S::vector<double> value;
+    // Standard error of the mean over the randomizations.
+    S::vector<double> error;
+    size_t samples{0};
+};
+
+// Randomized quasi-Monte Carlo: each randomization integrates points [0, samples) of its own scrambled Sobol
+// sequence, and the spread of their estimates gives the error. samples should be a power of two.
+template<size_t IN = dynamicDimension, size_t OUT = dynamicDimension, typename Integrand>
+RqmcResult RQMCIntegrator(size_t samples, size_t in_dimension, size_t out_dimension, Integrand &&integrand,
+                          size_t randomizations, uint64_t seed, ThreadPool &pool = ThreadPool::global()) {
+    assert(randomizations > 1);
+    const auto directions = SobolDirections(in_dimension);
+    auto samplers = S::vector<SobolSampler>();
+    for (size_t r{0}; r < randomizations; r++) samplers.emplace_back(directions, seed, r);
 
-    return map([=](auto v) { return v / samples; }, result);
+    const auto chunks{(samples + reproducibleChunk - 1) / reproducibleChunk};
+    auto chunkResults = S::vector<Buffer<double, OUT>>(randomizations * chunks);
+    pool.parallelFor(chunkResults.size(), [&](size_t, size_t c) {
+        const auto first{c % chunks * reproducibleChunk};
+        chunkResults[c] = integrateChunk<IN, OUT>(first, S::min(first + reproducibleChunk, samples),
+                                                  in_dimension, out_dimension, integrand, samplers[c / chunks]);
+    });
+
+    RqmcResult result{S::vector<double>(out_dimension), S::vector<double>(out_dimension), samples * randomizations};
+    auto sumSquares = S::vector<double>(out_dimension);
+    for (size_t r{0}; r < randomizations; r++) {
+        const auto estimate{compensatedTotal<OUT>(S::span{chunkResults.data() + r * chunks, chunks}, out_dimension)};
+        for (size_t k{0}; k < out_dimension; k++) {
+            const auto mean{estimate[k] / samples};
+            result.value[k] += mean;
+            sumSquares[k] += mean * mean;
+        }
+    }
+    for (size_t k{0}; k < out_dimension; k++) {
+        result.value[k] /= randomizations;
+        const auto variance{(sumSquares[k] / randomizations - result.value[k] * result.value[k]) *
+                            randomizations / (randomizations - 1)};
+        result.error[k] = S::sqrt(S::max(variance, 0.0) / randomizations);
+    }
+    return result;
 }
 
-auto ParallelMCIntegrator(size_t samples, size_t in_dimension, size_t out_dimension, GENERATOR generator) {
-    auto concurrency = std::thread::hardware_concurrency();
-    auto results = S::vector<S::vector<double>>(concurrency);
-    S::vector<S::thread> threads;
+// VEGAS importance sampling: a seeded integration mode whose separable grid adapts to output 0.
+struct VegasOptions {
+    size_t bins{64};
+    size_t iterations{10};
+    // Iterations used only to adapt the grid; their estimates are not part of the result.
+    size_t warmup{2};
+    size_t samplesPerIteration{size_t{1} << 16};
+    // Grid damping: lower values adapt more slowly but are more robust on noisy integrands.
+    double alpha{1.5};
+};
+
+struct VegasResult {
+    S::vector<double> value;
+    S::vector<double> error;
+    // Consistency of the per-iteration estimates of output 0; values well above 1 mean the grid was still moving.
+    double chi2PerDof{0};
+    size_t samples{0};
+};
+
+// Separable VEGAS grid: every dimension of the unit hypercube is cut into bins of equal probability.
+struct VegasGrid {
+    size_t dimensions;
+    size_t bins;
+    S::vector<double> edges;
+
+    VegasGrid(size_t dimensions, size_t bins) : dimensions(dimensions), bins(bins), edges(dimensions * (bins + 1)) {
+        for (size_t d{0}; d < dimensions; d++)
+            for (size_t b{0}; b <= bins; b++) edges[d * (bins + 1) + b] = static_cast<double>(b) / bins;
+    }
 
-    for (auto i{0}; i < concurrency; i++){
-        auto threadRes = &results[i];
-        threads.emplace_back(std::thread([=]() {
-            *threadRes = MCIntegrator(samples / concurrency, in_dimension, out_dimension, generator);
-        }));
+    // Maps uniforms u to points x of the grid density and returns the Jacobian; bin receives the bin of each
+    // dimension. x may be u.
+    double map(const float *u, float *x, uint32_t *bin) const {
+        double jacobian{1.0};
+        for (size_t d{0}; d < dimensions; d++) {
+            const auto scaled{u[d] * bins};
+            const auto b{S::min(static_cast<uint32_t>(scaled), static_cast<uint32_t>(bins - 1))};
+            const auto lo{edges[d * (bins + 1) + b]}, hi{edges[d * (bins + 1) + b + 1]};
+            x[d] = static_cast<float>(lo + (scaled - b) * (hi - lo));
+            jacobian *= bins * (hi - lo);
+            bin[d] = b;
+        }
+        return jacobian;
     }
 
-    for (auto &t : threads) t.join();
+    // Moves the bin edges toward equal shares of binWeights, the sums of (f * jacobian)^2 per dimension and bin.
+    void refine(const S::vector<double> &binWeights, double alpha) {
+        auto smoothed = S::vector<double>(bins);
+        auto importance = S::vector<double>(bins);
+        auto refined = S::vector<double>(bins + 1);
+
+        for (size_t d{0}; d < dimensions; d++) {
+            const auto weights{binWeights.begin() + d * bins};
+            for (size_t b{0}; b < bins; b++) {
+                const auto lo{b == 0 ? b : b - 1}, hi{b + 1 == bins ? b + 1 : b + 2};
+                smoothed[b] = S::accumulate(weights + lo, weights + hi, 0.0) / (hi - lo);
+            }
+            const auto total{S::accumulate(smoothed.begin(), smoothed.end(), 0.0)};
+            if (total <= 0) continue;
+
+            for (size_t b{0}; b < bins; b++) {
+                const auto share{smoothed[b] / total};
+                importance[b] = share > 0 && share < 1 ? S::pow((1 - share) / S::log(1 / share), alpha) : 0;
+            }
+            const auto delta{S::accumulate(importance.begin(), importance.end(), 0.0) / bins};
+            if (delta <= 0) continue;
+
+            const auto old{edges.begin() + d * (bins + 1)};
+            refined[0] = 0.0;
+            refined[bins] = 1.0;
+            auto accumulated{0.0};
+            size_t k{0};
+            for (size_t b{1}; b < bins; b++) {
+                while (accumulated < delta && k < bins) accumulated += importance[k++];
+                accumulated -= delta;
+                refined[b] = old[k] - (old[k] - old[k - 1]) * accumulated / importance[k - 1];
+            }
+            S::copy(refined.begin(), refined.end(), old);
+        }
+    }
+};
+
+// IntegrationBuffers plus the grid bin of every input dimension of the current sample.
+template<size_t IN, size_t OUT>
+struct VegasBuffers : IntegrationBuffers<IN, OUT> {
+    Buffer<uint32_t, IN> bins;
+
+    void prepare(size_t in_dimension, size_t out_dimension) {
+        IntegrationBuffers<IN, OUT>::prepare(in_dimension, out_dimension);
+        if constexpr (IN == dynamicDimension) resizePadded(bins, in_dimension);
+    }
+};
+
+template<size_t IN = dynamicDimension, size_t OUT = dynamicDimension>
+using VegasContext = IntegratorContext<IN, OUT, VegasBuffers<IN, OUT>>;
+
+// VEGAS integration over the unit hypercube; the iterations after warmup are combined by the inverse variance of
+// output 0. Sample i of iteration t gets the uniforms of CounterSampler{seed} at t * samplesPerIteration + i, and
+// every iteration reduces in chunk order, so the grid and the result depend on the seed alone.
+template<size_t IN, size_t OUT, typename Integrand>
+VegasResult VegasIntegrator(VegasContext<IN, OUT> &context, size_t in_dimension, size_t out_dimension,
+                            Integrand &&integrand, const VegasOptions &options, uint64_t seed,
+                            ThreadPool &pool = ThreadPool::global()) {
+    const auto s{CounterSampler{seed}};
+    const auto n{options.samplesPerIteration};
+    const auto chunks{(n + reproducibleChunk - 1) / reproducibleChunk};
+    // Per chunk: the sums and sums of squares of the outputs, then the bin weights of the grid.
+    const auto weightsOffset{2 * out_dimension}, stride{weightsOffset + in_dimension * options.bins};
+    auto grid = VegasGrid(in_dimension, options.bins);
+    auto binWeights = S::vector<double>(in_dimension * options.bins);
+    auto sum = makeBuffer<CompensatedSum, OUT>(out_dimension);
+    auto sumSquares = makeBuffer<CompensatedSum, OUT>(out_dimension);
+
+    auto weightedSum = S::vector<double>(out_dimension), weightedVariance = S::vector<double>(out_dimension);
+    auto totalWeight{0.0};
+    S::vector<S::pair<double, double>> history;
+    VegasResult result;
+    context.begin(pool.size(), in_dimension, out_dimension);
+
+    for (size_t iteration{0}; iteration < options.iterations; iteration++) {
+        context.chunkSums.assign(chunks * stride, 0.0);
+        pool.parallelFor(chunks, [&](size_t worker, size_t c) {
+            auto &b{context.local(worker)};
+            const auto sums{context.chunkSums.data() + c * stride};
+            const auto first{c * reproducibleChunk};
+            for (auto i{first}; i < S::min(first + reproducibleChunk, n); i++) {
+                s.fill(iteration * n + i, b.input.data(), in_dimension);
+                const auto jacobian{grid.map(b.input.data(), b.input.data(), b.bins.data())};
+                S::fill(b.sample.begin(), b.sample.end(), 0.0f);
+                integrand(b.input, b.sample);
+                for (size_t k{0}; k < out_dimension; k++) {
+                    const auto f{b.sample[k] * jacobian};
+                    sums[k] += f;
+                    sums[out_dimension + k] += f * f;
+                }
+                const auto f0{out_dimension ? b.sample[0] * jacobian : 0.0};
+                for (size_t d{0}; d < in_dimension; d++) sums[weightsOffset + d * options.bins + b.bins[d]] += f0 * f0;
+            }
+        });
+
+        S::fill(sum.begin(), sum.end(), CompensatedSum{});
+        S::fill(sumSquares.begin(), sumSquares.end(), CompensatedSum{});
+        S::fill(binWeights.begin(), binWeights.end(), 0.0);
+        for (size_t c{0}; c < chunks; c++) {
+            const auto sums{context.chunkSums.data() + c * stride};
+            for (size_t k{0}; k < out_dimension; k++) {
+                sum[k].add(sums[k]);
+                sumSquares[k].add(sums[out_dimension + k]);
+            }
+            addVectorsInPlace(binWeights, S::span{sums + weightsOffset, binWeights.size()});
+        }
+        grid.refine(binWeights, options.alpha);
+        if (iteration < options.warmup) continue;
+
+        result.samples += n;
+        auto weight{0.0};
+        for (size_t k{0}; k < out_dimension; k++) {
+            const auto mean{sum[k].value() / n};
+            const auto variance{S::max((sumSquares[k].value() / n - mean * mean) / (n - 1), 1e-300)};
+            if (k == 0) {
+                weight = 1 / variance;
+                history.emplace_back(mean, variance);
+            }
+            weightedSum[k] += weight * mean;
+            weightedVariance[k] += weight * weight * variance;
+        }
+        totalWeight += weight;
+    }
+
+    for (size_t k{0}; k < out_dimension; k++) {
+        result.value.push_back(totalWeight > 0 ? weightedSum[k] / totalWeight : 0.0);
+        result.error.push_back(totalWeight > 0 ? S::sqrt(weightedVariance[k]) / totalWeight : 0.0);
+    }
+    if (history.size() > 1) {
+        for (const auto &[mean, variance] : history)
+            result.chi2PerDof += (mean - result.value[0]) * (mean - result.value[0]) / variance;
+        result.chi2PerDof /= history.size() - 1;
+    }
+    return result;
+}
+
+template<size_t IN = dynamicDimension, size_t OUT = dynamicDimension, typename Integrand>
+VegasResult VegasIntegrator(size_t in_dimension, size_t out_dimension, Integrand &&integrand,
+                            const VegasOptions &options, uint64_t seed, ThreadPool &pool = ThreadPool::global()) {
+    auto context = VegasContext<IN, OUT>();
+    return VegasIntegrator(context, in_dimension, out_dimension, integrand, options, seed, pool);
+}
+
+// Batch integrand: evaluates count samples per call. Both blocks are column-major with a leading dimension of
+// count, i.e. dimension d of sample i is input[d * count + i] and output k of sample i is output[k * count + i].
+typedef void BATCH_GENERATOR(const float *input, float *output, size_t count);
+
+constexpr size_t integrationBlock{1 << 10};
+
+// Input and output blocks of one batch integration plus the running sums of the output columns.
+struct BatchBuffers {
+    size_t in_dimension{0};
+    S::vector<float> input;
+    S::vector<float> output;
+    S::vector<CompensatedSum> sum;
+
+    BatchBuffers() = default;
+
+    BatchBuffers(size_t in_dimension, size_t out_dimension, size_t block) : in_dimension(in_dimension) {
+        resizePadded(input, in_dimension * block);
+        resizePadded(output, out_dimension * block);
+        resizePadded(sum, out_dimension);
+    }
+};
+
+// Adds the batch integrand's outputs for count samples drawn from s to b.sum.
+template<typename Integrand>
+inline void integrateBatchInto(BatchBuffers &b, size_t count, Integrand &integrand, LaneSampler &s) {
+    const auto out_dimension{b.sum.size()};
+    for (size_t first{0}; first < count; first += integrationBlock) {
+        const auto n{S::min(integrationBlock, count - first)};
+        s.fill(b.input.data(), b.in_dimension * n);
+        integrand(static_cast<const float *>(b.input.data()), b.output.data(), n);
+        for (size_t k{0}; k < out_dimension; k++) b.sum[k].add(pairwiseSum(b.output.data() + k * n, n));
+    }
+}
+
+template<typename Integrand>
+auto BatchMCIntegrator(size_t samples, size_t in_dimension, size_t out_dimension, Integrand &&integrand) {
+    auto b = BatchBuffers(in_dimension, out_dimension, integrationBlock);
+    integrateBatchInto(b, samples, integrand, threadSampler());
+    return averaged(valuesOf<dynamicDimension>(b.sum), samples);
+}
+
+template<typename Integrand>
+auto ParallelBatchMCIntegrator(size_t samples, size_t in_dimension, size_t out_dimension, Integrand &&integrand,
+                               ThreadPool &pool = ThreadPool::global()) {
+    const auto blocks{S::max(size_t{1}, integrationChunk(samples, pool.size()) / integrationBlock)};
+    const auto chunk{blocks * integrationBlock};
+    auto workers = S::vector<Padded<BatchBuffers>>(pool.size());
 
-    auto result = S::vector<double>(out_dimension);
+    pool.parallelFor((samples + chunk - 1) / chunk, [&](size_t worker, size_t c) {
+        auto &w{workers[worker].value};
+        if (w.sum.empty()) w = BatchBuffers(in_dimension, out_dimension, integrationBlock);
+        integrateBatchInto(w, S::min((c + 1) * chunk, samples) - c * chunk, integrand, threadSampler());
+    });
 
-    for (const auto &r : results) addVectorsInPlace(result, r);
-    return map([=](auto el) { return el / concurrency; }, result);
+    auto result = S::vector<CompensatedSum>(out_dimension);
+    for (const auto &w : workers) if (!w.value.sum.empty()) addCompensated(result, w.value.sum);
+    return averaged(valuesOf<dynamicDimension>(result), samples);
 }
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <numeric>
+#include <iostream>
+
+#include "functional_helpers.hpp"
+#include "MCIntegrator.h"
+#include "networkLoader.h"
+#include "networkSampler.h"
+
+namespace S = std;
+
+template<typename Function>
+double nanosecondsPerCall(size_t calls, Function &&fn) {
+    using namespace std::chrono;
+    const auto start = high_resolution_clock::now();
+    fn();
+    return duration<double, S::nano>(high_resolution_clock::now() - start).count() / calls;
+}
+
+// Uniform floats per second from the scalar Sampler and the lane-parallel LaneSampler, in bulk fill() calls.
+void benchmarkUniforms(size_t draws = size_t{1} << 28) {
+    Sampler scalar;
+    LaneSampler lanes;
+    auto buffer = S::vector<float>(1 << 12);
+    const auto blocks{draws / buffer.size()};
+
+    const auto scalarNs = nanosecondsPerCall(draws, [&]() { for (size_t b{0}; b < blocks; b++) scalar.fill(buffer); });
+    const auto lanesNs = nanosecondsPerCall(draws, [&]() { for (size_t b{0}; b < blocks; b++) lanes.fill(buffer); });
+    std::cout << "---Fill--- Samples per second: [millions] Sampler " << 1e3 / scalarNs
+              << " LaneSampler " << 1e3 / lanesNs << '\n';
+}
+
+inline void quarterCircle(const S::vector<float> &in, S::vector<float> &out) {
+    out[0] = (in[0] * in[0] + in[1] * in[1]) < 1 ? 4.0f : 0.0f;
+}
+
+inline void quarterCircleBatch(const float *in, float *out, size_t count) {
+    for (size_t i{0}; i < count; i++) out[i] = (in[i] * in[i] + in[count + i] * in[count + i]) < 1 ? 4.0f : 0.0f;
+}
+
+// The pi integrand through a GENERATOR pointer, an inlined fixed-dimension lambda and a batch integrand.
+void benchmarkIntegrators(size_t samples = size_t{1} << 26) {
+    const auto pointerNs = nanosecondsPerCall(samples, [&]() { MCIntegrator(samples, 2, 1, quarterCircle); });
+    const auto inlinedNs = nanosecondsPerCall(samples, [&]() {
+        MCIntegrator<2, 1>(samples, [](const auto &in, auto &out) {
+            out[0] = (in[0] * in[0] + in[1] * in[1]) < 1 ? 4.0f : 0.0f;
+        });
+    });
+    const auto batchNs = nanosecondsPerCall(samples, [&]() { BatchMCIntegrator(samples, 2, 1, quarterCircleBatch); });
+    std::cout << "---Pi--- Samples per second: [millions] GENERATOR " << 1e3 / pointerNs
+              << " inlined<2, 1> " << 1e3 / inlinedNs << " batch " << 1e3 / batchNs << '\n';
+}
+
+// Cost per draw of binary search, linear scan and alias table on CPT rows of increasing arity.
+void benchmarkRowSelection(size_t draws = 1 << 24) {
+    Sampler s;
+    const size_t batch{1 << 16};
+    auto uniforms = S::vector<float>(batch);
+    auto lines = S::vector<size_t>(batch);
+    volatile size_t sink;
+
+    std::cout << "arity  cumulative[ns]  linear[ns]  alias[ns]\n";
+    for (const size_t arity : {2, 4, 8, 16, 32, 64, 128, 256}) {
+        const auto rows{(size_t{1} << 16) / arity};
+        auto cpt = S::vector<float>(rows * arity);
+        s.fill(cpt);
+        for (auto line{cpt.begin()}; line < cpt.end(); line += arity) {
+            const auto total{S::accumulate(line, line + arity, 0.0f)};
+            S::transform(line, line + arity, line, [=](auto p) { return p / total; });
+        }
+
+        const auto cumulative = CumulativeCpt(cpt, {rows});
+        const auto alias = CumulativeCpt::getAliasTable(cpt, arity);
+        s.fill(uniforms);
+        for (auto &l : lines) l = static_cast<size_t>(s.next() * rows) % rows * arity;
+
+        const auto cumulativeNs = nanosecondsPerCall(draws, [&]() {
+            size_t acc{0};
+            for (size_t i{0}; i < draws; i++)
+                acc += CumulativeCpt::getCumulativeState(cumulative.cumulativeCpt.data() + lines[i % batch], arity,
+                                                         uniforms[i % batch]);
+            sink = acc;
+        });
+        const auto linearNs = nanosecondsPerCall(draws, [&]() {
+            size_t acc{0};
+            for (size_t i{0}; i < draws; i++) {
+                const auto line{cumulative.cumulativeCpt.data() + lines[i % batch]};
+                for (size_t j{0}; j + 1 < arity; j++) acc += uniforms[i % batch] >= line[j];
+            }
+            sink = acc;
+        });
+        const auto aliasNs = nanosecondsPerCall(draws, [&]() {
+            size_t acc{0};
+            for (size_t i{0}; i < draws; i++)
+                acc += CumulativeCpt::getAliasState(alias.data() + lines[i % batch], arity, uniforms[i % batch]);
+            sink = acc;
+        });
+        std::cout << arity << "      " << cumulativeNs << "      " << linearNs << "      " << aliasNs << '\n';
+    }
+    (void) sink;
+}
+
+// Error against sample count of seeded MC and RQMC on a smooth 4-dimensional integrand with exact value 1.
+void benchmarkRqmc(size_t randomizations = 16) {
+    const auto smooth = [](const auto &in, auto &out) {
+        float product{1.0f};
+        for (const auto x : in) product *= 1.5707964f * S::sin(3.1415927f * x);
+        out[0] = product;
+    };
+    std::cout << "samples  MC error  RQMC error\n";
+    for (size_t samples{1 << 10}; samples <= (1 << 20); samples <<= 2) {
+        double sum{0}, sumSquares{0};
+        for (uint64_t seed{0}; seed < randomizations; seed++) {
+            const auto v{MCIntegrator<4, 1>(samples, 4, 1, smooth, seed)[0]};
+            sum += v;
+            sumSquares += v * v;
+        }
+        const auto mean{sum / randomizations};
+        const auto mcError{S::sqrt((sumSquares / randomizations - mean * mean) / (randomizations - 1))};
+        const auto rqmc{RQMCIntegrator<4, 1>(samples, 4, 1, smooth, randomizations, 0)};
+        std::cout << samples << "  " << mcError << "  " << rqmc.error[0] << '\n';
+    }
+}
+
+// Samples and time the sequential integrator needs for pi to absoluteError, against a fixed maxSamples budget.
+void benchmarkSequential(double absoluteError = 1e-3, size_t maxSamples = size_t{1} << 26) {
+    const auto pi = [](const auto &in, auto &out) { out[0] = (in[0] * in[0] + in[1] * in[1]) < 1 ? 4.0f : 0.0f; };
+    StoppingRule rule{absoluteError};
+    rule.maxSamples = maxSamples;
+    SequentialResult result;
+    const auto sequentialNs = nanosecondsPerCall(1, [&]() { result = SequentialMCIntegrator<2, 1>(2, 1, pi, rule, 1); });
+    const auto fixedNs = nanosecondsPerCall(1, [&]() { ParallelMCIntegrator<2, 1>(maxSamples, 2, 1, pi, 1); });
+    std::cout << "---Sequential--- pi " << result.value[0] << " +- " << result.halfWidth[0] << " in " << result.samples
+              << " samples, " << sequentialNs / 1e6 << "[ms] against " << fixedNs / 1e6 << "[ms] for " << maxSamples
+              << '\n';
+}
+
+// RMS error over seeds of VEGAS and of ParallelMCIntegrator given the same total number of samples, on a narrow
+// 4-dimensional Gaussian with integral 1 up to its negligible tails.
+void benchmarkVegas(size_t seeds = 8) {
+    const auto peaked = [](const auto &in, auto &out) {
+        constexpr float width{0.05f}, norm{1 / (width * 2.5066283f)};
+        float product{1.0f};
+        for (const auto x : in) product *= norm * S::exp(-(x - 0.5f) * (x - 0.5f) / (2 * width * width));
+        out[0] = product;
+    };
+    const VegasOptions options;
+    const auto samples{options.iterations * options.samplesPerIteration};
+    double vegasSquares{0}, mcSquares{0};
+    for (uint64_t seed{0}; seed < seeds; seed++) {
+        const auto vegas{VegasIntegrator<4, 1>(4, 1, peaked, options, seed).value[0]};
+        const auto mc{ParallelMCIntegrator<4, 1>(samples, 4, 1, peaked, seed)[0]};
+        vegasSquares += (vegas - 1) * (vegas - 1);
+        mcSquares += (mc - 1) * (mc - 1);
+    }
+    std::cout << "---Vegas--- RMS error at " << samples << " samples: ParallelMCIntegrator "
+              << S::sqrt(mcSquares / seeds) << " VEGAS " << S::sqrt(vegasSquares / seeds) << '\n';
+}
+
+// Particles per second of NetworkSampler on the network at file compiled with float rows, sampled from uniforms,
+// and with integer thresholds, sampled from the raw draws.
+void benchmarkRawDraws(const S::string &file, size_t particles = size_t{1} << 20) {
+    const BN_Network raw(file);
+    const CompiledNetwork floats(raw), thresholds(raw, true);
+    NetworkSampler floatSampler(floats), rawSampler(thresholds);
+    auto states = S::vector<State>(floats.size() * particles);
+    const NodeMajorView<State> view{states.data(), particles, particles};
+    // The first pass allocates the per-worker tiles.
+    floatSampler.sample(view, 0);
+    rawSampler.sample(view, 0);
+
+    const auto floatNs = nanosecondsPerCall(particles, [&]() { floatSampler.sample(view, 1); });
+    const auto rawNs = nanosecondsPerCall(particles, [&]() { rawSampler.sample(view, 1); });
+    std::cout << "---Network--- Particles per second: [millions] uniforms " << 1e3 / floatNs << " raw draws "
+              << 1e3 / rawNs << '\n';
+}
@@ -0,0 +1,458 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cassert>
+#include <new>
+#include <map>
+#include <limits>
+#include <string>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+
+#include "functional_helpers.hpp"
+#include "simdKernels.h"
+#include "networkLoader.h"
+
+namespace S = std;
+
+using State = uint32_t;
+
+template<typename T, size_t ALIGN = 64>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    template<typename U>
+    struct rebind { typedef AlignedAllocator<U, ALIGN> other; };
+
+    AlignedAllocator() = default;
+
+    template<typename U>
+    constexpr AlignedAllocator(const AlignedAllocator<U, ALIGN> &) noexcept {}
+
+    T *allocate(size_t n) { return static_cast<T *>(::operator new(n * sizeof(T), S::align_val_t{ALIGN})); }
+
+    void deallocate(T *p, size_t) noexcept { ::operator delete(p, S::align_val_t{ALIGN}); }
+
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, ALIGN> &) const noexcept { return true; }
+};
+
+template<typename T>
+using AlignedVector = S::vector<T, AlignedAllocator<T>>;
+
+// Node-major matrix view: row n holds one value per particle for node n, rows are ld elements apart.
+template<typename T>
+struct NodeMajorView {
+    T *data;
+    size_t ld;
+    size_t count;
+
+    [[nodiscard]] T *row(size_t node) const { return data + node * ld; }
+
+    [[nodiscard]] NodeMajorView columns(size_t first, size_t last) const { return {data + first, ld, last - first}; }
+};
+
+// Immutable, topologically ordered flattening of a BN_Network, indexed by compiled node. Cumulative rows live in
+// arena (aliasArena for alias tables, thresholdArena for integer thresholds), log rows in logArena.
+struct CompiledNetwork {
+    // Upper bound pinned into the last slot of every row, so any draw in [0, 1] lands inside the row.
+    static constexpr float rowCap{2.0f};
+    // Particles processed per node before moving to the next one; the tile of parent states stays in L1.
+    static constexpr size_t batchTile{256};
+    // Rows up to this size are selected by the branchless kernels in simdKernels.h.
+    static constexpr size_t simdMaxArity{16};
+    // Evidence entry of a node that is not observed.
+    static constexpr State unobserved{S::numeric_limits<State>::max()};
+    // Log of a zero probability; finite, so sums of it stay finite under -ffast-math.
+    static constexpr float logZero{-1e30f};
+
+    S::vector<S::string> ids;
+    S::vector<S::vector<S::string>> stateIds;
+    S::vector<size_t> sourceIndex;
+    // Default sample budget of queries on the network, from the XDSL numsamples attribute; 0 when not given.
+    size_t numSamples{0};
+
+    S::vector<uint32_t> arity;
+    S::vector<uint32_t> rowWidth;
+    S::vector<uint32_t> parentOffsets;
+    S::vector<uint32_t> parentIndices;
+    S::vector<uint32_t> parentStrides;
+    S::vector<size_t> tableOffsets;
+    S::vector<uint8_t> aliasRows;
+    AlignedVector<float> arena;
+    AlignedVector<uint32_t> thresholdArena;
+    AlignedVector<AliasSlot> aliasArena;
+    // logArena[logOffsets[node] + offset - tableOffsets[node] + state] is the log probability of state in the
+    // row at offset; padding holds logZero.
+    S::vector<size_t> logOffsets;
+    AlignedVector<float> logArena;
+
+    [[nodiscard]] size_t size() const { return arity.size(); }
+
+    [[nodiscard]] size_t indexOf(const S::string &id) const {
+        return S::find(ids.begin(), ids.end(), id) - ids.begin();
+    }
+
+    // Rows of the node's table, one per configuration of its parents.
+    [[nodiscard]] size_t rowCount(size_t node) const {
+        size_t rows{1};
+        for (auto p{parentOffsets[node]}; p < parentOffsets[node + 1]; p++) rows *= arity[parentIndices[p]];
+        return rows;
+    }
+
+    [[nodiscard]] State stateOf(size_t node, const S::string &stateId) const {
+        return S::find(stateIds[node].begin(), stateIds[node].end(), stateId) - stateIds[node].begin();
+    }
+
+    [[nodiscard]] size_t rowOffset(size_t node, const State *nodeStates) const {
+        auto offset{tableOffsets[node]};
+        for (auto p{parentOffsets[node]}; p < parentOffsets[node + 1]; p++)
+            offset += nodeStates[parentIndices[p]] * parentStrides[p];
+        return offset;
+    }
+
+    [[nodiscard]] static State drawState(const float *line, size_t lineSize, const float sample) {
+        return CumulativeCpt::getCumulativeState(line, lineSize, sample);
+    }
+
+    [[nodiscard]] static State drawState(const AliasSlot *line, size_t lineSize, const float sample) {
+        return CumulativeCpt::getAliasState(line, lineSize, sample);
+    }
+
+    [[nodiscard]] static State drawState(const uint32_t *line, size_t lineSize, const uint32_t draw) {
+        return CumulativeCpt::getThresholdState(line, lineSize, draw);
+    }
+
+    [[nodiscard]] static State drawState(const AliasSlot *line, size_t lineSize, const uint32_t draw) {
+        return CumulativeCpt::getAliasState(line, lineSize, draw);
+    }
+
+    template<typename U>
+    [[nodiscard]] const auto *rows() const {
+        if constexpr (S::is_same_v<U, float>) return arena.data();
+        else return thresholdArena.data();
+    }
+
+    [[nodiscard]] static uint32_t paddedWidth(uint32_t lineSize) {
+        return lineSize <= 8 ? 8 : lineSize <= simdMaxArity ? simdMaxArity : lineSize;
+    }
+
+    [[nodiscard]] State drawState(size_t node, size_t offset, const float sample) const {
+        if (aliasRows[node]) return drawState(aliasArena.data() + offset, arity[node], sample);
+        switch (rowWidth[node]) {
+            case 8: return selectState8(arena.data() + offset, sample);
+            case simdMaxArity: return selectState16(arena.data() + offset, sample);
+            default: return drawState(arena.data() + offset, arity[node], sample);
+        }
+    }
+
+    [[nodiscard]] State drawState(size_t node, size_t offset, const uint32_t draw) const {
+        if (aliasRows[node]) return drawState(aliasArena.data() + offset, arity[node], draw);
+        return arity[node] <= simdMaxArity
+               ? selectState(thresholdArena.data() + offset, arity[node], draw)
+               : drawState(thresholdArena.data() + offset, arity[node], draw);
+    }
+
+    // inputSample and nodeStates are indexed in compiled (topological) order.
+    void sample(const S::vector<float> &inputSample, S::vector<State> &nodeStates) const {
+        sampleOne(inputSample, nodeStates);
+    }
+
+    void sample(const S::vector<uint32_t> &draws, S::vector<State> &nodeStates) const {
+        assert(!thresholdArena.empty());
+        sampleOne(draws, nodeStates);
+    }
+
+    template<typename U>
+    void sampleOne(const S::vector<U> &draws, S::vector<State> &nodeStates) const {
+        for (size_t n{0}; n < size(); n++)
+            nodeStates[n] = drawState(n, rowOffset(n, nodeStates.data()), draws[n]);
+    }
+
+    void rowOffsets(size_t node, NodeMajorView<const State> states, uint32_t *offsets) const {
+        S::fill_n(offsets, states.count, static_cast<uint32_t>(tableOffsets[node]));
+        for (auto p{parentOffsets[node]}; p < parentOffsets[node + 1]; p++) {
+            const auto parentStates{states.row(parentIndices[p])};
+            const auto stride{parentStrides[p]};
+            for (size_t i{0}; i < states.count; i++) offsets[i] += parentStates[i] * stride;
+        }
+    }
+
+    // Samples states.count particles at once. Both matrices are node-major in compiled order and
+    // uniforms must provide one draw per node and particle.
+    void sampleBatch(NodeMajorView<const float> uniforms, NodeMajorView<State> states) const {
+        sampleTiles(uniforms, states);
+    }
+
+    void sampleBatch(NodeMajorView<const uint32_t> draws, NodeMajorView<State> states) const {
+        assert(!thresholdArena.empty());
+        sampleTiles(draws, states);
+    }
+
+    // Clamps observed nodes to their evidence state; logWeights[i] receives the log likelihood of particle i's
+    // evidence.
+    void sampleBatch(NodeMajorView<const float> uniforms, NodeMajorView<State> states, const State *evidence,
+                     float *logWeights) const {
+        sampleTiles(uniforms, states, evidence, logWeights);
+    }
+
+    void sampleBatch(NodeMajorView<const uint32_t> draws, NodeMajorView<State> states, const State *evidence,
+                     float *logWeights) const {
+        assert(!thresholdArena.empty());
+        sampleTiles(draws, states, evidence, logWeights);
+    }
+
+    // Clamps a tile of node n to state and adds the log probability of the rows its particles select.
+    void clampTile(size_t n, State state, NodeMajorView<const State> parentTile, uint32_t *offsets, State *out,
+                   float *logWeights) const {
+        S::fill_n(out, parentTile.count, state);
+        rowOffsets(n, parentTile, offsets);
+        const auto logRow{logArena.data() + logOffsets[n] + state};
+        const auto table{static_cast<uint32_t>(tableOffsets[n])};
+        for (size_t i{0}; i < parentTile.count; i++) logWeights[i] += logRow[offsets[i] - table];
+    }
+
+    // Samples node n for every particle of tile from the uniforms u, reading the parents' rows of the tile.
+    template<typename U>
+    void sampleNode(size_t n, const U *u, NodeMajorView<State> tile, uint32_t *offsets) const {
+        const auto base{rows<U>()};
+        const auto out{tile.row(n)};
+        const auto lineSize{arity[n]};
+        const auto small{!aliasRows[n] && lineSize <= simdMaxArity};
+
+        if (small && parentOffsets[n] == parentOffsets[n + 1]) {
+            selectStatesShared(base + tableOffsets[n], lineSize, u, out, tile.count);
+            return;
+        }
+
+        rowOffsets(n, {tile.data, tile.ld, tile.count}, offsets);
+        if (aliasRows[n])
+            for (size_t i{0}; i < tile.count; i++) out[i] = drawState(aliasArena.data() + offsets[i], lineSize, u[i]);
+        else if (small)
+            selectStatesGather(base, offsets, lineSize, u, out, tile.count);
+        else
+            for (size_t i{0}; i < tile.count; i++) out[i] = drawState(base + offsets[i], lineSize, u[i]);
+    }
+
+    template<typename U>
+    void sampleTiles(NodeMajorView<const U> uniforms, NodeMajorView<State> states, const State *evidence = nullptr,
+                     float *logWeights = nullptr) const {
+        alignas(64) uint32_t offsets[batchTile];
+        if (evidence) S::fill_n(logWeights, states.count, 0.0f);
+
+        for (size_t first{0}; first < states.count; first += batchTile) {
+            const auto tile{states.columns(first, S::min(first + batchTile, states.count))};
+
+            for (size_t n{0}; n < size(); n++) {
+                if (evidence && evidence[n] != unobserved)
+                    clampTile(n, evidence[n], {tile.data, tile.ld, tile.count}, offsets, tile.row(n), logWeights + first);
+                else
+                    sampleNode(n, uniforms.row(n) + first, tile, offsets);
+            }
+        }
+    }
+
+    // Moves the columns marked alive to the front of rows [0, nodes) of tile, keeping their order.
+    static void compactColumns(NodeMajorView<State> tile, size_t nodes, const uint8_t *alive) {
+        for (size_t n{0}; n < nodes; n++) {
+            const auto row{tile.row(n)};
+            size_t k{0};
+            for (size_t i{0}; i < tile.count; i++) {
+                row[k] = row[i];
+                k += alive[i];
+            }
+        }
+    }
+
+    // Rejection sampling of states.count proposals; fill(n, first, count) must provide row n of uniforms for
+    // those columns before node n is drawn. Returns the accepted count, in columns [0, accepted) of states.
+    template<typename Fill>
+    size_t sampleRejecting(NodeMajorView<const float> uniforms, NodeMajorView<State> states, const State *evidence,
+                           size_t &nodeSamples, Fill &&fill) const {
+        return rejectTiles(uniforms, states, evidence, nodeSamples, fill);
+    }
+
+    template<typename Fill>
+    size_t sampleRejecting(NodeMajorView<const uint32_t> draws, NodeMajorView<State> states, const State *evidence,
+                           size_t &nodeSamples, Fill &&fill) const {
+        assert(!thresholdArena.empty());
+        return rejectTiles(draws, states, evidence, nodeSamples, fill);
+    }
+
+    template<typename U, typename Fill>
+    size_t rejectTiles(NodeMajorView<const U> uniforms, NodeMajorView<State> states, const State *evidence,
+                       size_t &nodeSamples, Fill &fill) const {
+        alignas(64) uint32_t offsets[batchTile];
+        alignas(64) uint8_t alive[batchTile];
+        size_t accepted{0};
+
+        for (size_t first{0}; first < states.count; first += batchTile) {
+            auto tile{states.columns(first, S::min(first + batchTile, states.count))};
+            S::fill_n(alive, tile.count, uint8_t{1});
+            auto live{tile.count};
+
+            for (size_t n{0}; n < size() && live; n++) {
+                fill(n, first, tile.count);
+                sampleNode(n, uniforms.row(n) + first, tile, offsets);
+                nodeSamples += tile.count;
+                if (evidence[n] == unobserved) continue;
+
+                const auto out{tile.row(n)};
+                live = 0;
+                for (size_t i{0}; i < tile.count; i++) {
+                    alive[i] &= out[i] == evidence[n];
+                    live += alive[i];
+                }
+                if (live * 2 > tile.count) continue;
+                compactColumns(tile, n + 1, alive);
+                tile.count = live;
+                S::fill_n(alive, live, uint8_t{1});
+            }
+
+            if (live == 0) continue;
+            if (live < tile.count) compactColumns(tile, size(), alive);
+            if (accepted < first)
+                for (size_t n{0}; n < size(); n++) S::copy_n(tile.row(n), live, states.row(n) + accepted);
+            accepted += live;
+        }
+        return accepted;
+    }
+
+    // Replaces node's distribution, sampling and log rows alike, by table: rowCount(node) rows rowWidth apart.
+    void setTable(size_t node, const float *table) {
+        const auto lineSize{arity[node]}, width{rowWidth[node]};
+        const auto rows{rowCount(node)};
+        S::vector<float> line(lineSize);
+
+        for (size_t r{0}; r < rows; r++) {
+            const auto row{table + r * width};
+            const auto total{S::accumulate(row, row + lineSize, 0.0)};
+            for (size_t x{0}; x < lineSize; x++) line[x] = static_cast<float>(row[x] / total);
+            const auto log{logArena.begin() + logOffsets[node] + r * width};
+            for (size_t x{0}; x < lineSize; x++) log[x] = line[x] > 0 ? S::log(line[x]) : logZero;
+
+            const auto slot{tableOffsets[node] + r * width};
+            if (aliasRows[node]) {
+                const auto alias{CumulativeCpt::getAliasTable(line, lineSize)};
+                S::copy(alias.begin(), alias.end(), aliasArena.begin() + slot);
+                continue;
+            }
+            auto cumulative{0.0};
+            for (size_t x{0}; x + 1 < lineSize; x++) {
+                cumulative += line[x];
+                arena[slot + x] = static_cast<float>(cumulative);
+                if (!thresholdArena.empty()) thresholdArena[slot + x] = CumulativeCpt::toThreshold(cumulative);
+            }
+        }
+    }
+
+    // Copies node's distribution back from from, a network of the same structure this one was copied from.
+    void copyTable(size_t node, const CompiledNetwork &from) {
+        const auto size{rowCount(node) * rowWidth[node]};
+        S::copy_n(from.logArena.begin() + logOffsets[node], size, logArena.begin() + logOffsets[node]);
+        const auto slot{tableOffsets[node]};
+        if (aliasRows[node]) {
+            S::copy_n(from.aliasArena.begin() + slot, size, aliasArena.begin() + slot);
+            return;
+        }
+        S::copy_n(from.arena.begin() + slot, size, arena.begin() + slot);
+        if (!thresholdArena.empty()) S::copy_n(from.thresholdArena.begin() + slot, size, thresholdArena.begin() + slot);
+    }
+
+    static S::vector<size_t> topologicalOrder(const BN_Network &network) {
+        auto order = S::vector<size_t>(network.nodes.size());
+        S::iota(order.begin(), order.end(), size_t{0});
+        S::stable_sort(order.begin(), order.end(), [&](auto a, auto b) {
+            return network.nodes[a]->depth < network.nodes[b]->depth;
+        });
+        return order;
+    }
+
+    explicit CompiledNetwork(const BN_Network &network, bool integerThresholds = false) :
+            sourceIndex(topologicalOrder(network)), numSamples(network.numSamples) {
+        S::map<const RawNode *, uint32_t> compiledIndex;
+        for (size_t n{0}; n < sourceIndex.size(); n++) compiledIndex[network.nodes[sourceIndex[n]]] = n;
+
+        parentOffsets.push_back(0);
+        for (const auto i : sourceIndex) {
+            const auto node{network.nodes[i]};
+            const auto &cumulative{node->cumulativeCpt};
+
+            ids.push_back(node->id);
+            stateIds.push_back(node->stateIds);
+            const auto lineSize{static_cast<uint32_t>(cumulative.lineSize)};
+            const auto aliased{!cumulative.aliasTable.empty()};
+            arity.push_back(lineSize);
+            rowWidth.push_back(aliased ? lineSize : paddedWidth(lineSize));
+
+            for (size_t p{0}; p < node->parents.size(); p++) {
+                parentIndices.push_back(compiledIndex.at(node->parents[p]));
+                parentStrides.push_back(cumulative.pRadix[p] / lineSize * rowWidth.back());
+            }
+            parentOffsets.push_back(parentIndices.size());
+
+            logOffsets.push_back(logArena.size());
+            for (auto line{node->cpt.begin()}; line < node->cpt.end(); line += lineSize) {
+                const auto total{S::accumulate(line, line + lineSize, 0.0)};
+                for (auto p{line}; p < line + lineSize; p++)
+                    logArena.push_back(*p > 0 ? static_cast<float>(S::log(*p / total)) : logZero);
+                logArena.resize(logArena.size() + rowWidth.back() - lineSize, logZero);
+            }
+
+            aliasRows.push_back(aliased);
+            if (aliased) {
+                tableOffsets.push_back(aliasArena.size());
+                aliasArena.insert(aliasArena.end(), cumulative.aliasTable.begin(), cumulative.aliasTable.end());
+                continue;
+            }
+
+            // The last slot and the padding hold rowCap, so every row stays sorted.
+            const auto width{rowWidth.back()};
+            if (width <= simdMaxArity) arena.resize((arena.size() + width - 1) / width * width, rowCap);
+            tableOffsets.push_back(arena.size());
+            for (auto line{cumulative.cumulativeCpt.begin()}; line < cumulative.cumulativeCpt.end(); line += lineSize) {
+                arena.insert(arena.end(), line, line + lineSize - 1);
+                arena.resize(arena.size() + width - lineSize + 1, rowCap);
+            }
+
+            if (!integerThresholds) continue;
+            thresholdArena.resize(tableOffsets.back(), S::numeric_limits<uint32_t>::max());
+            for (auto line{cumulative.thresholds.begin()}; line < cumulative.thresholds.end(); line += lineSize) {
+                thresholdArena.insert(thresholdArena.end(), line, line + lineSize);
+                thresholdArena.resize(thresholdArena.size() + width - lineSize, S::numeric_limits<uint32_t>::max());
+            }
+        }
+        arena.shrink_to_fit();
+        thresholdArena.shrink_to_fit();
+        aliasArena.shrink_to_fit();
+        logArena.shrink_to_fit();
+        // The gather kernels index rows with signed 32-bit offsets.
+        assert(arena.size() < S::numeric_limits<int32_t>::max());
+        assert(aliasArena.size() < S::numeric_limits<uint32_t>::max());
+    }
+};
+
+// Observed states of a query, indexed by compiled node; nodes without evidence hold CompiledNetwork::unobserved.
+struct Evidence {
+    S::vector<State> states;
+
+    explicit Evidence(const CompiledNetwork &network) : states(network.size(), CompiledNetwork::unobserved) {}
+
+    // Observations as (node id, state id) pairs.
+    Evidence(const CompiledNetwork &network, const S::vector<S::pair<S::string, S::string>> &observations) :
+            Evidence(network) {
+        for (const auto &[id, state] : observations) {
+            const auto node{network.indexOf(id)};
+            assert(node < network.size() && network.stateOf(node, state) < network.arity[node]);
+            set(node, network.stateOf(node, state));
+        }
+    }
+
+    void set(size_t node, State state) { states[node] = state; }
+
+    [[nodiscard]] bool observed(size_t node) const { return states[node] != CompiledNetwork::unobserved; }
+
+    [[nodiscard]] const State *data() const { return states.data(); }
+};
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+
+#include "threadPool.h"
+#include "compiledNetwork.h"
+#include "networkSampler.h"
+
+namespace S = std;
+
+// Children of every node with the node's stride in their rows, and a coloring of the moral graph: nodes of one
+// color share no Markov blanket, so they can be resampled at once.
+struct MarkovBlankets {
+    S::vector<uint32_t> childOffsets;
+    S::vector<uint32_t> childIndices;
+    // Stride of the node in the child's rows, as in CompiledNetwork::parentStrides.
+    S::vector<uint32_t> childStrides;
+    // Nodes of color c are colorNodes[colorOffsets[c] .. colorOffsets[c + 1]), in compiled order.
+    S::vector<uint32_t> colorOffsets;
+    S::vector<uint32_t> colorNodes;
+    uint32_t maxArity{0};
+
+    [[nodiscard]] size_t colors() const { return colorOffsets.size() - 1; }
+
+    // Unnormalized log conditional of node n given the rest of each of at most batchTile particles, state x of
+    // particle i in logit[x * batchTile + i].
+    void logConditionals(const CompiledNetwork &network, size_t n, NodeMajorView<const State> states, float *logit,
+                         uint32_t *offsets) const {
+        constexpr auto ld{CompiledNetwork::batchTile};
+        const auto arity{network.arity[n]};
+        const auto log{network.logArena.data()};
+
+        network.rowOffsets(n, states, offsets);
+        const auto own{network.logOffsets[n] - network.tableOffsets[n]};
+        for (uint32_t x{0}; x < arity; x++)
+            for (size_t i{0}; i < states.count; i++) logit[x * ld + i] = log[own + offsets[i] + x];
+
+        const auto current{states.row(n)};
+        for (auto c{childOffsets[n]}; c < childOffsets[n + 1]; c++) {
+            const auto child{childIndices[c]}, stride{childStrides[c]};
+            const auto childStates{states.row(child)};
+            network.rowOffsets(child, states, offsets);
+            const auto table{network.logOffsets[child] - network.tableOffsets[child]};
+            for (size_t i{0}; i < states.count; i++) {
+                const auto row{table + offsets[i] - current[i] * stride + childStates[i]};
+                for (uint32_t x{0}; x < arity; x++) logit[x * ld + i] += log[row + x * stride];
+            }
+        }
+    }
+
+    explicit MarkovBlankets(const CompiledNetwork &network) {
+        const auto size{network.size()};
+        S::vector<S::vector<S::pair<uint32_t, uint32_t>>> children(size);
+        S::vector<S::vector<uint32_t>> neighbours(size);
+        for (size_t n{0}; n < size; n++) {
+            maxArity = S::max(maxArity, network.arity[n]);
+            for (auto p{network.parentOffsets[n]}; p < network.parentOffsets[n + 1]; p++) {
+                const auto parent{network.parentIndices[p]};
+                children[parent].emplace_back(n, network.parentStrides[p]);
+                neighbours[parent].push_back(n);
+                neighbours[n].push_back(parent);
+                // Parents of a common child are married in the moral graph.
+                for (auto q{network.parentOffsets[n]}; q < p; q++) {
+                    neighbours[parent].push_back(network.parentIndices[q]);
+                    neighbours[network.parentIndices[q]].push_back(parent);
+                }
+            }
+        }
+
+        childOffsets.push_back(0);
+        for (const auto &c : children) {
+            for (const auto &[child, stride] : c) {
+                childIndices.push_back(child);
+                childStrides.push_back(stride);
+            }
+            childOffsets.push_back(childIndices.size());
+        }
+
+        // Greedy coloring in compiled order: the smallest color no colored neighbour has.
+        auto color = S::vector<uint32_t>(size);
+        S::vector<uint8_t> taken;
+        uint32_t colorCount{0};
+        for (size_t n{0}; n < size; n++) {
+            taken.assign(neighbours[n].size() + 1, 0);
+            for (const auto m : neighbours[n]) if (m < n && color[m] < taken.size()) taken[color[m]] = 1;
+            color[n] = S::find(taken.begin(), taken.end(), 0) - taken.begin();
+            colorCount = S::max(colorCount, color[n] + 1);
+        }
+        colorOffsets.assign(colorCount + 1, 0);
+        for (const auto c : color) colorOffsets[c + 1]++;
+        S::partial_sum(colorOffsets.begin(), colorOffsets.end(), colorOffsets.begin());
+        colorNodes.resize(size);
+        auto next{colorOffsets};
+        for (size_t n{0}; n < size; n++) colorNodes[next[color[n]]++] = n;
+    }
+};
+
+struct GibbsOptions {
+    // Independent chains, run batchTile at a time; with fewer tiles than workers each color is split over the pool.
+    size_t chains{1024};
+    // Sweeps discarded before counting.
+    size_t burnIn{256};
+    // Sweeps counted per chain.
+    size_t samples{1024};
+    // Sweeps run per counted sweep.
+    size_t thinning{1};
+};
+
+struct GibbsResult {
+    // Posterior probability of every state of the target nodes, the states of each node in turn.
+    S::vector<double> value;
+    // Gelman-Rubin R-hat of every target state across chains; above about 1.1 the chains have not mixed.
+    S::vector<double> rHat;
+    size_t chains{0};
+    size_t samplesPerChain{0};
+
+    [[nodiscard]] double maxRHat() const { return rHat.empty() ? 1.0 : *S::max_element(rHat.begin(), rHat.end()); }
+};
+
+// Chromatic Gibbs sampling: chains are the columns of node-major tiles and a sweep resamples the unobserved nodes
+// color by color. Chains start from a likelihood-weighting draw with the evidence clamped.
+struct GibbsSampler {
+    NetworkSampler &sampler;
+    MarkovBlankets blankets;
+    // Per-worker unnormalized log conditionals, maxArity rows of batchTile chains.
+    S::vector<Padded<AlignedVector<float>>> logits;
+
+    explicit GibbsSampler(NetworkSampler &sampler) :
+            sampler(sampler), blankets(sampler.network), logits(sampler.pool.size()) {}
+
+    [[nodiscard]] float *logitTile(size_t worker) {
+        auto &tile{logits[worker].value};
+        if (tile.empty()) tile.resize(blankets.maxArity * CompiledNetwork::batchTile);
+        return tile.data();
+    }
+
+    // Draws node n of every chain of tile from its conditional given the rest of the chain.
+    void resample(const CompiledNetwork &network, size_t n, NodeMajorView<State> tile, const float *u, float *logit,
+                  uint32_t *offsets) const {
+        constexpr auto ld{CompiledNetwork::batchTile};
+        const auto arity{network.arity[n]};
+        const auto current{tile.row(n)};
+        blankets.logConditionals(network, n, {tile.data, tile.ld, tile.count}, logit, offsets);
+
+        for (size_t i{0}; i < tile.count; i++) {
+            auto top{logit[i]};
+            for (uint32_t x{1}; x < arity; x++) top = S::max(top, logit[x * ld + i]);
+            auto total{0.0f};
+            for (uint32_t x{0}; x < arity; x++) total += logit[x * ld + i] = S::exp(logit[x * ld + i] - top);
+            const auto target{u[i] * total};
+            State state{0};
+            auto cumulative{logit[i]};
+            while (state + 1 < arity && cumulative <= target) cumulative += logit[++state * ld + i];
+            current[i] = state;
+        }
+    }
+
+    // Runs the chains with each color of every sweep split over the pool by tile and node range; calls
+    // observe(sweep, tile, first) for every tile after each sweep.
+    template<typename Function>
+    void sampleByColor(const Evidence &evidence, const CounterSampler &s, size_t chains, size_t sweeps,
+                       Function &&observe) {
+        constexpr auto tileSize{CompiledNetwork::batchTile};
+        const auto &network{sampler.network};
+        const auto tiles{(chains + tileSize - 1) / tileSize}, ld{tiles * tileSize};
+        const auto parts{(sampler.pool.size() + tiles - 1) / tiles};
+        const auto blocks{(network.size() + NetworkSampler::uniformBlock - 1) / NetworkSampler::uniformBlock};
+        auto chainStates = AlignedVector<State>(network.size() * ld);
+        auto chainUniforms = AlignedVector<float>(network.size() * ld);
+        const auto view = [&](auto &arena, size_t t) {
+            return NodeMajorView{arena.data() + t * tileSize, ld, S::min(tileSize, chains - t * tileSize)};
+        };
+
+        sampler.pool.parallelFor(tiles, [&](size_t worker, size_t t) {
+            const auto u{view(chainUniforms, t)};
+            sampler.fillUniforms(s, t * tileSize, u);
+            sampler.localNetwork(worker).sampleBatch({u.data, u.ld, u.count}, view(chainStates, t), evidence.data(),
+                                                     sampler.logWeightTile(worker));
+        });
+        for (size_t sweep{1}; sweep <= sweeps; sweep++) {
+            sampler.pool.parallelFor(tiles * parts, [&](size_t, size_t job) {
+                const auto t{job / parts}, part{job % parts};
+                const auto firstNode{blocks * part / parts * NetworkSampler::uniformBlock};
+                const auto lastNode{S::min(network.size(), blocks * (part + 1) / parts * NetworkSampler::uniformBlock)};
+                sampler.fillUniforms(s, sweep * chains + t * tileSize, view(chainUniforms, t), firstNode, lastNode);
+            });
+            for (size_t c{0}; c < blankets.colors(); c++) {
+                const auto first{blankets.colorOffsets[c]}, size{blankets.colorOffsets[c + 1] - first};
+                sampler.pool.parallelFor(tiles * parts, [&](size_t worker, size_t job) {
+                    alignas(64) uint32_t rowOffsets[tileSize];
+                    const auto t{job / parts}, part{job % parts};
+                    const auto u{view(chainUniforms, t)};
+                    const auto tile{view(chainStates, t)};
+                    const auto &local{sampler.localNetwork(worker)};
+                    for (auto k{first + size * part / parts}; k < first + size * (part + 1) / parts; k++) {
+                        const auto n{blankets.colorNodes[k]};
+                        if (!evidence.observed(n)) resample(local, n, tile, u.row(n), logitTile(worker), rowOffsets);
+                    }
+                });
+            }
+            for (size_t t{0}; t < tiles; t++) {
+                const auto tile{view(chainStates, t)};
+                observe(sweep, NodeMajorView<const State>{tile.data, tile.ld, tile.count}, t * tileSize);
+            }
+        }
+    }
+
+    // Posterior marginals of the target compiled nodes given evidence. Sweep k of chain j uses the uniforms of
+    // particle k * chains + j, so a seed gives the same chains for any pool size.
+    GibbsResult sample(const S::vector<size_t> &targets, const Evidence &evidence, const GibbsOptions &options,
+                       uint64_t seed) {
+        assert(options.thinning > 0);
+        const auto s{CounterSampler{seed}};
+        const auto &network{sampler.network};
+        auto offsets = S::vector<size_t>{0};
+        for (const auto n : targets) offsets.push_back(offsets.back() + network.arity[n]);
+        const auto states{offsets.back()};
+        const auto sweeps{options.burnIn + options.samples * options.thinning};
+        // Counts of every target state per chain, for the value and the between-chain spread.
+        auto chainCounts = S::vector<uint32_t>(options.chains * states);
+        constexpr auto tileSize{CompiledNetwork::batchTile};
+        const auto tiles{(options.chains + tileSize - 1) / tileSize};
+
+        const auto counted = [&](size_t sweep) {
+            return sweep > options.burnIn && (sweep - options.burnIn) % options.thinning == 0;
+        };
+        const auto addCounts = [&](NodeMajorView<const State> tile, size_t first) {
+            for (size_t q{0}; q < targets.size(); q++) {
+                const auto row{tile.row(targets[q])};
+                for (size_t i{0}; i < tile.count; i++) chainCounts[(first + i) * states + offsets[q] + row[i]]++;
+            }
+        };
+
+        if (tiles >= sampler.pool.size()) {
+            sampler.pool.parallelFor(tiles, [&](size_t worker, size_t t) {
+                alignas(64) uint32_t rowOffsets[tileSize];
+                const auto &local{sampler.localNetwork(worker)};
+                const auto first{t * tileSize}, count{S::min(tileSize, options.chains - first)};
+                const NodeMajorView<float> u{sampler.uniformTile(worker), NetworkSampler::chunk, count};
+                const NodeMajorView<State> tile{sampler.stateTile(worker), NetworkSampler::chunk, count};
+                const auto logit{logitTile(worker)};
+
+                sampler.fillUniforms(s, first, u);
+                local.sampleBatch({u.data, u.ld, count}, tile, evidence.data(), sampler.logWeightTile(worker));
+
+                for (size_t sweep{1}; sweep <= sweeps; sweep++) {
+                    sampler.fillUniforms(s, sweep * options.chains + first, u);
+                    for (const auto n : blankets.colorNodes)
+                        if (!evidence.observed(n)) resample(local, n, tile, u.row(n), logit, rowOffsets);
+                    if (counted(sweep)) addCounts({tile.data, tile.ld, tile.count}, first);
+                }
+            });
+        } else {
+            sampleByColor(evidence, s, options.chains, sweeps, [&](size_t sweep, NodeMajorView<const State> tile,
+                                                                    size_t first) {
+                if (counted(sweep)) addCounts(tile, first);
+            });
+        }
+
+        GibbsResult result{S::vector<double>(states), S::vector<double>(states), options.chains, options.samples};
+        const auto n{static_cast<double>(options.samples)}, m{static_cast<double>(options.chains)};
+        for (size_t k{0}; k < states; k++) {
+            double sum{0}, sumSquares{0}, within{0};
+            for (size_t c{0}; c < options.chains; c++) {
+                const auto mean{chainCounts[c * states + k] / n};
+                sum += mean;
+                sumSquares += mean * mean;
+                within += mean * (1 - mean) * n / S::max(n - 1, 1.0);
+            }
+            const auto mean{sum / m};
+            within /= m;
+            const auto between{n * S::max(sumSquares - m * mean * mean, 0.0) / S::max(m - 1, 1.0)};
+            result.value[k] = mean;
+            result.rHat[k] = within > 0 ? S::sqrt(((n - 1) / n * within + between / n) / within) : between > 0 ? 1e30 : 1.0;
+        }
+        return result;
+    }
+};
@@ -0,0 +1,273 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <numeric>
+#include <algorithm>
+
+#include "threadPool.h"
+#include "compiledNetwork.h"
+#include "networkSampler.h"
+#include "likelihoodWeighting.h"
+
+namespace S = std;
+
+struct AdaptiveOptions {
+    // Learning rounds, each drawing samplesPerRound particles from the current importance tables.
+    size_t rounds{10};
+    size_t samplesPerRound{size_t{1} << 14};
+    // Particles of the final sampling phase, the only ones the estimate is made of.
+    size_t samples{size_t{1} << 20};
+    // Start from the CPTs reweighted by loopy belief propagation (EPIS-BN) rather than from the CPTs (AIS-BN).
+    bool loopyInit{true};
+    size_t loopyIterations{8};
+    // Learning rate of round k of K is a (b / a)^(k / K), with a = learningRate and b = finalLearningRate.
+    double learningRate{0.4};
+    double finalLearningRate{0.14};
+    // Importance probabilities below epsilon are raised to it, unless the CPT entry itself is zero.
+    double epsilon{0.01};
+};
+
+// Loopy belief propagation lambdas: lambdas[stateOffsets[n] + x] is proportional to the likelihood of the
+// evidence below node n given n = x.
+inline S::vector<double> loopyLambdas(const CompiledNetwork &network, const Evidence &evidence, size_t iterations,
+                                      const S::vector<size_t> &stateOffsets) {
+    const auto size{network.size()};
+    const auto edges{network.parentIndices.size()};
+    // Message e lives on edge parentIndices[e] -> its child and has one entry per state of the parent.
+    auto messageOffsets = S::vector<size_t>{0};
+    for (size_t e{0}; e < edges; e++) messageOffsets.push_back(messageOffsets.back() + network.arity[network.parentIndices[e]]);
+    auto pi = S::vector<double>(messageOffsets.back(), 1.0), lambda = S::vector<double>(messageOffsets.back(), 1.0);
+    auto lambdas = S::vector<double>(stateOffsets.back(), 1.0);
+    S::vector<S::vector<uint32_t>> childEdges(size);
+    for (size_t n{0}; n < size; n++)
+        for (auto e{network.parentOffsets[n]}; e < network.parentOffsets[n + 1]; e++)
+            childEdges[network.parentIndices[e]].push_back(e);
+
+    const auto normalize = [](double *v, size_t count) {
+        const auto total{S::accumulate(v, v + count, 0.0)};
+        for (size_t x{0}; x < count; x++) v[x] = total > 0 ? v[x] / total : 1.0 / count;
+    };
+    const auto evidenceFactor = [&](size_t n, size_t x) {
+        return evidence.observed(n) && evidence.states[n] != x ? 0.0 : 1.0;
+    };
+    // Calls fn(offset, parentStates) for every row of node n, offset relative to its table.
+    const auto forEachRow = [&](size_t n, S::vector<uint32_t> &states, auto &&fn) {
+        const auto first{network.parentOffsets[n]}, parents{network.parentOffsets[n + 1] - first};
+        states.assign(parents, 0);
+        for (size_t offset{0};;) {
+            fn(offset, states);
+            size_t k{0};
+            for (; k < parents; k++) {
+                offset += network.parentStrides[first + k];
+                if (++states[k] < network.arity[network.parentIndices[first + k]]) break;
+                offset -= states[k] * network.parentStrides[first + k];
+                states[k] = 0;
+            }
+            if (k == parents) return;
+        }
+    };
+    const auto probability = [&](size_t n, size_t offset, size_t x) {
+        return static_cast<double>(S::exp(network.logArena[network.logOffsets[n] + offset + x]));
+    };
+
+    S::vector<double> belief;
+    S::vector<uint32_t> states;
+    for (size_t iteration{0}; iteration < iterations; iteration++) {
+        for (size_t n{0}; n < size; n++) {
+            const auto arity{network.arity[n]};
+            const auto first{network.parentOffsets[n]};
+            belief.assign(arity, 0.0);
+            forEachRow(n, states, [&](size_t offset, const S::vector<uint32_t> &u) {
+                auto weight{1.0};
+                for (size_t k{0}; k < u.size(); k++) weight *= pi[messageOffsets[first + k] + u[k]];
+                for (size_t x{0}; x < arity; x++) belief[x] += weight * probability(n, offset, x);
+            });
+            for (const auto e : childEdges[n]) {
+                const auto message{pi.data() + messageOffsets[e]};
+                for (size_t x{0}; x < arity; x++) {
+                    message[x] = belief[x] * evidenceFactor(n, x);
+                    for (const auto f : childEdges[n]) if (f != e) message[x] *= lambda[messageOffsets[f] + x];
+                }
+                normalize(message, arity);
+            }
+        }
+
+        for (auto n{size}; n-- > 0;) {
+            const auto arity{network.arity[n]};
+            const auto first{network.parentOffsets[n]}, parents{network.parentOffsets[n + 1] - first};
+            const auto own{lambdas.data() + stateOffsets[n]};
+            for (size_t x{0}; x < arity; x++) {
+                own[x] = evidenceFactor(n, x);
+                for (const auto f : childEdges[n]) own[x] *= lambda[messageOffsets[f] + x];
+            }
+            normalize(own, arity);
+
+            for (size_t i{0}; i < parents; i++) S::fill_n(lambda.data() + messageOffsets[first + i],
+                                                          network.arity[network.parentIndices[first + i]], 0.0);
+            forEachRow(n, states, [&](size_t offset, const S::vector<uint32_t> &u) {
+                auto likelihood{0.0};
+                for (size_t x{0}; x < arity; x++) likelihood += own[x] * probability(n, offset, x);
+                for (size_t i{0}; i < parents; i++) {
+                    auto weight{likelihood};
+                    for (size_t k{0}; k < parents; k++) if (k != i) weight *= pi[messageOffsets[first + k] + u[k]];
+                    lambda[messageOffsets[first + i] + u[i]] += weight;
+                }
+            });
+            for (size_t i{0}; i < parents; i++)
+                normalize(lambda.data() + messageOffsets[first + i], network.arity[network.parentIndices[first + i]]);
+        }
+    }
+    return lambdas;
+}
+
+// Adaptive importance sampling (AIS-BN, EPIS-BN): the unobserved ancestors of the evidence sample from importance
+// tables in proposal, learned over rounds from the weighted particles, and particles are weighted by P / Q.
+struct AdaptiveImportanceSampler {
+    NetworkSampler &sampler;
+    CompiledNetwork proposal;
+    NetworkSampler proposalSampler;
+    // Unobserved ancestors of the evidence of the current query, in compiled order.
+    S::vector<size_t> adapted;
+    // Importance table of adapted[a], in the layout of the node's log rows, from tableOffsets[a].
+    S::vector<size_t> tableOffsets;
+    S::vector<float> tables;
+
+    explicit AdaptiveImportanceSampler(NetworkSampler &sampler) :
+            sampler(sampler), proposal(sampler.network), proposalSampler(proposal, sampler.pool) {}
+
+    // proposalSampler refers to proposal, so a copy would sample the original's tables.
+    AdaptiveImportanceSampler(const AdaptiveImportanceSampler &) = delete;
+
+    AdaptiveImportanceSampler &operator=(const AdaptiveImportanceSampler &) = delete;
+
+    [[nodiscard]] size_t tableSize(size_t node) const { return proposal.rowCount(node) * proposal.rowWidth[node]; }
+
+    // Raises entries below epsilon, except impossible ones, and normalizes every row of adapted[a].
+    void cutoff(size_t a, double epsilon) {
+        const auto n{adapted[a]};
+        const auto width{proposal.rowWidth[n]};
+        const auto prior{sampler.network.logArena.data() + sampler.network.logOffsets[n]};
+        for (size_t row{0}; row < tableSize(n); row += width) {
+            const auto t{tables.data() + tableOffsets[a] + row};
+            for (size_t x{0}; x < proposal.arity[n]; x++)
+                if (prior[row + x] > CompiledNetwork::logZero / 2) t[x] = S::max(t[x], static_cast<float>(epsilon));
+            const auto total{S::accumulate(t, t + proposal.arity[n], 0.0)};
+            for (size_t x{0}; x < proposal.arity[n]; x++) t[x] = static_cast<float>(t[x] / total);
+        }
+    }
+
+    // Starts a query: restores the previous query's rows and sets the importance tables of the new one.
+    void prepare(const Evidence &evidence, const AdaptiveOptions &options) {
+        const auto &network{sampler.network};
+        for (const auto n : adapted) proposal.copyTable(n, network);
+        auto below = S::vector<uint8_t>(network.size());
+        for (auto n{network.size()}; n-- > 0;)
+            if (below[n] || evidence.observed(n))
+                for (auto p{network.parentOffsets[n]}; p < network.parentOffsets[n + 1]; p++)
+                    below[network.parentIndices[p]] = 1;
+        adapted.clear();
+        for (size_t n{0}; n < network.size(); n++) if (below[n] && !evidence.observed(n)) adapted.push_back(n);
+
+        auto stateOffsets = S::vector<size_t>{0};
+        for (const auto a : network.arity) stateOffsets.push_back(stateOffsets.back() + a);
+        const auto lambdas{options.loopyInit ? loopyLambdas(network, evidence, options.loopyIterations, stateOffsets)
+                                             : S::vector<double>(stateOffsets.back(), 1.0)};
+
+        tableOffsets.assign(1, 0);
+        for (const auto n : adapted) tableOffsets.push_back(tableOffsets.back() + tableSize(n));
+        tables.assign(tableOffsets.back(), 0.0f);
+        for (size_t a{0}; a < adapted.size(); a++) {
+            const auto n{adapted[a]};
+            const auto width{network.rowWidth[n]};
+            for (size_t row{0}; row < tableSize(n); row += width)
+                for (size_t x{0}; x < network.arity[n]; x++)
+                    tables[tableOffsets[a] + row + x] = static_cast<float>(
+                            S::exp(network.logArena[network.logOffsets[n] + row + x]) * lambdas[stateOffsets[n] + x]);
+            cutoff(a, options.epsilon);
+            proposal.setTable(n, tables.data() + tableOffsets[a]);
+        }
+    }
+
+    // Adds log P - log Q of every adapted node to the log weights of a tile of particles.
+    void addLogRatios(NodeMajorView<const State> states, float *logWeights, uint32_t *offsets) const {
+        const auto &network{sampler.network};
+        for (const auto n : adapted) {
+            proposal.rowOffsets(n, states, offsets);
+            const auto row{states.row(n)};
+            const auto log{network.logOffsets[n] - network.tableOffsets[n]};
+            for (size_t i{0}; i < states.count; i++) {
+                const auto slot{log + offsets[i] + row[i]};
+                logWeights[i] += network.logArena[slot] - proposal.logArena[slot];
+            }
+        }
+    }
+
+    // Posterior marginals of the target compiled nodes given evidence; learning rounds and the final phase use
+    // consecutive particle ranges of the seed.
+    PosteriorResult sample(const S::vector<size_t> &targets, const Evidence &evidence, const AdaptiveOptions &options,
+                           uint64_t seed) {
+        const auto s{CounterSampler{seed}};
+        prepare(evidence, options);
+        auto learning = S::vector<Padded<WeightedCounts>>(sampler.pool.size());
+
+        for (size_t round{0}; round < options.rounds; round++) {
+            for (auto &w : learning) {
+                w.value = {};
+                w.value.sums.resize(tables.size());
+            }
+            proposalSampler.forEachWeightedTile(round * options.samplesPerRound, options.samplesPerRound, s, evidence,
+                                                [&](size_t worker, size_t, NodeMajorView<State> tile, float *logWeights) {
+                alignas(64) uint32_t offsets[NetworkSampler::chunk];
+                const NodeMajorView<const State> states{tile.data, tile.ld, tile.count};
+                auto &w{learning[worker].value};
+                addLogRatios(states, logWeights, offsets);
+                if (!w.weigh(logWeights, states.count)) return;
+                for (size_t a{0}; a < adapted.size(); a++) {
+                    const auto n{adapted[a]};
+                    proposal.rowOffsets(n, states, offsets);
+                    const auto row{states.row(n)};
+                    const auto table{tableOffsets[a] - proposal.tableOffsets[n]};
+                    for (size_t i{0}; i < states.count; i++) w.sums[table + offsets[i] + row[i]] += w.tileWeights[i];
+                }
+            });
+
+            WeightedCounts total;
+            for (const auto &w : learning) total.merge(w.value);
+            if (!total.possible) continue;
+            const auto rate{options.learningRate * S::pow(options.finalLearningRate / options.learningRate,
+                                                          static_cast<double>(round) / options.rounds)};
+            for (size_t a{0}; a < adapted.size(); a++) {
+                const auto n{adapted[a]};
+                const auto arity{proposal.arity[n]}, width{proposal.rowWidth[n]};
+                for (size_t row{0}; row < tableSize(n); row += width) {
+                    const auto counts{total.sums.data() + tableOffsets[a] + row};
+                    const auto rowWeight{S::accumulate(counts, counts + arity, 0.0)};
+                    if (rowWeight <= 0) continue;
+                    const auto t{tables.data() + tableOffsets[a] + row};
+                    for (size_t x{0}; x < arity; x++) t[x] += static_cast<float>(rate * (counts[x] / rowWeight - t[x]));
+                }
+                cutoff(a, options.epsilon);
+                proposal.setTable(n, tables.data() + tableOffsets[a]);
+            }
+        }
+
+        auto offsets = S::vector<size_t>{0};
+        for (const auto n : targets) offsets.push_back(offsets.back() + proposal.arity[n]);
+        auto counts = S::vector<Padded<WeightedCounts>>(sampler.pool.size());
+        proposalSampler.forEachWeightedTile(options.rounds * options.samplesPerRound, options.samples, s, evidence,
+                                            [&](size_t worker, size_t, NodeMajorView<State> tile, float *logWeights) {
+            alignas(64) uint32_t rowOffsets[NetworkSampler::chunk];
+            const NodeMajorView<const State> states{tile.data, tile.ld, tile.count};
+            auto &c{counts[worker].value};
+            if (c.sums.empty()) c.sums.resize(offsets.back());
+            addLogRatios(states, logWeights, rowOffsets);
+            c.add(states, logWeights, targets, offsets);
+        });
+
+        WeightedCounts total;
+        for (const auto &c : counts) total.merge(c.value);
+        return total.result(offsets.back());
+    }
+};
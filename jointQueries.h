@@ -0,0 +1,255 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cassert>
+#include <numeric>
+#include <algorithm>
+#include <type_traits>
+
+#include "networkLoader.h"
+#include "threadPool.h"
+#include "compiledNetwork.h"
+#include "networkSampler.h"
+#include "likelihoodWeighting.h"
+
+namespace S = std;
+
+// P(targets | given) for every configuration of the given nodes, or the joint of the targets when none are
+// given; query evidence is fixed separately by an Evidence. Nodes are compiled indices.
+struct JointQuery {
+    S::vector<size_t> targets;
+    S::vector<size_t> given;
+
+    explicit JointQuery(S::vector<size_t> targets, S::vector<size_t> given = {}) :
+            targets(S::move(targets)), given(S::move(given)) {}
+
+    JointQuery(const CompiledNetwork &network, const S::vector<S::string> &targets,
+               const S::vector<S::string> &given = {}) {
+        for (const auto &id : targets) {
+            this->targets.push_back(network.indexOf(id));
+            assert(this->targets.back() < network.size());
+        }
+        for (const auto &id : given) {
+            this->given.push_back(network.indexOf(id));
+            assert(this->given.back() < network.size());
+        }
+    }
+
+    // Given nodes first, as the parents of a CPT, then the targets.
+    [[nodiscard]] S::vector<size_t> nodes() const {
+        auto res{given};
+        res.insert(res.end(), targets.begin(), targets.end());
+        return res;
+    }
+};
+
+// Open-addressing map from cell index to weight, for tables too large to keep densely.
+struct HashedCells {
+    static constexpr uint64_t empty{~uint64_t{0}};
+
+    S::vector<uint64_t> keys;
+    S::vector<double> values;
+    size_t used{0};
+
+    static uint64_t hash(uint64_t key) {
+        key *= 0x9E3779B97F4A7C15ull;
+        return key ^ key >> 29;
+    }
+
+    void add(uint64_t key, double weight) {
+        if (2 * (used + 1) > keys.size()) grow();
+        const auto mask{keys.size() - 1};
+        auto slot{hash(key) & mask};
+        while (keys[slot] != key && keys[slot] != empty) slot = (slot + 1) & mask;
+        if (keys[slot] == empty) {
+            keys[slot] = key;
+            used++;
+        }
+        values[slot] += weight;
+    }
+
+    void grow() {
+        HashedCells bigger;
+        bigger.keys.assign(S::max<size_t>(1024, 2 * keys.size()), empty);
+        bigger.values.resize(bigger.keys.size());
+        for (size_t slot{0}; slot < keys.size(); slot++)
+            if (keys[slot] != empty) bigger.add(keys[slot], values[slot]);
+        *this = S::move(bigger);
+    }
+
+    void scale(double factor) { for (auto &v : values) v *= factor; }
+
+    template<typename Function>
+    void forEach(Function &&fn) const {
+        for (size_t slot{0}; slot < keys.size(); slot++) if (keys[slot] != empty) fn(keys[slot], values[slot]);
+    }
+};
+
+struct JointResult {
+    // Given nodes, then targets, and the mixed radix of each in a cell index.
+    S::vector<size_t> nodes;
+    S::vector<size_t> radix;
+    // Cells by increasing index, sum of state * radix over nodes, and their P(targets | given). Dense tables
+    // list every cell; hashed ones only cells some particle reached.
+    S::vector<uint64_t> cells;
+    S::vector<double> value;
+    size_t samples{0};
+    double effectiveSamples{0};
+
+    // states of nodes, in order.
+    [[nodiscard]] uint64_t index(const S::vector<State> &states) const {
+        uint64_t res{0};
+        for (size_t p{0}; p < nodes.size(); p++) res += states[p] * radix[p];
+        return res;
+    }
+
+    [[nodiscard]] double at(const S::vector<State> &states) const {
+        const auto cell{S::lower_bound(cells.begin(), cells.end(), index(states))};
+        return cell != cells.end() && *cell == index(states) ? value[cell - cells.begin()] : 0.0;
+    }
+};
+
+// Answers many joint and conditional queries from one pass of likelihood-weighted particles; tables of up to
+// denseLimit cells are dense, larger ones hashed.
+struct JointQueries {
+    struct Compiled {
+        S::vector<size_t> nodes;
+        S::vector<size_t> radix;
+        uint64_t cells{1};
+        // Cells per configuration of the given nodes.
+        uint64_t targetCells{1};
+        bool dense{true};
+        // First of the query's cells in the dense sums.
+        size_t offset{0};
+    };
+
+    struct Tables {
+        WeightedCounts counts;
+        S::vector<HashedCells> hashed;
+        S::vector<uint64_t> cells;
+    };
+
+    NetworkSampler &sampler;
+    S::vector<Compiled> queries;
+    size_t denseCells{0};
+
+    JointQueries(NetworkSampler &sampler, const S::vector<JointQuery> &specs, size_t denseLimit = size_t{1} << 16) :
+            sampler(sampler) {
+        const auto &network{sampler.network};
+        for (const auto &spec : specs) {
+            Compiled q;
+            q.nodes = spec.nodes();
+            auto sizes = S::vector<size_t>();
+            for (const auto n : q.nodes) {
+                assert(n < network.size());
+                sizes.push_back(network.arity[n]);
+                assert(q.cells <= S::numeric_limits<uint64_t>::max() / network.arity[n]);
+                q.cells *= network.arity[n];
+            }
+            for (const auto n : spec.targets) q.targetCells *= network.arity[n];
+            q.radix = CumulativeCpt::getRadix(sizes, q.cells);
+            q.dense = q.cells <= denseLimit;
+            q.offset = denseCells;
+            if (q.dense) denseCells += q.cells;
+            queries.push_back(S::move(q));
+        }
+    }
+
+    // Scatters a tile into worker tables t; the cell of particle i of query q is the dot product of its states
+    // with the radix.
+    void add(Tables &t, NodeMajorView<const State> tile) const {
+        t.cells.resize(tile.count);
+        const auto weights{t.counts.tileWeights.data()};
+        for (size_t q{0}; q < queries.size(); q++) {
+            const auto &query{queries[q]};
+            S::fill(t.cells.begin(), t.cells.end(), 0);
+            for (size_t p{0}; p < query.nodes.size(); p++) {
+                const auto row{tile.row(query.nodes[p])};
+                const uint64_t radix{query.radix[p]};
+                for (size_t i{0}; i < tile.count; i++) t.cells[i] += row[i] * radix;
+            }
+            if (query.dense) {
+                const auto table{t.counts.sums.data() + query.offset};
+                for (size_t i{0}; i < tile.count; i++) table[t.cells[i]] += weights[i];
+            } else {
+                for (size_t i{0}; i < tile.count; i++) t.hashed[q].add(t.cells[i], weights[i]);
+            }
+        }
+    }
+
+    // Answers of every query, in order, from particles [0, samples) of s with evidence clamped; an empty
+    // evidence gives prior joints.
+    template<typename Source> requires (!S::is_integral_v<Source>)
+    S::vector<JointResult> sample(const Evidence &evidence, size_t samples, const Source &s) {
+        auto workers = S::vector<Padded<Tables>>(sampler.pool.size());
+        sampler.forEachWeightedTile(0, samples, s, evidence, [&](size_t worker, size_t, NodeMajorView<State> tile,
+                                                                 const float *logWeights) {
+            auto &t{workers[worker].value};
+            if (t.hashed.empty()) {
+                t.counts.sums.resize(denseCells);
+                t.hashed.resize(queries.size());
+            }
+            const auto shift{t.counts.shift};
+            const auto possible{t.counts.possible};
+            if (!t.counts.weigh(logWeights, tile.count)) return;
+            if (possible && t.counts.shift != shift)
+                for (auto &h : t.hashed) h.scale(S::exp(shift - t.counts.shift));
+            add(t, {tile.data, tile.ld, tile.count});
+        });
+
+        WeightedCounts total;
+        for (const auto &w : workers) total.merge(w.value.counts);
+        total.sums.resize(denseCells);
+        auto results = S::vector<JointResult>();
+        for (size_t q{0}; q < queries.size(); q++) {
+            const auto &query{queries[q]};
+            JointResult res;
+            res.nodes = query.nodes;
+            res.radix = query.radix;
+            res.samples = total.samples;
+            if (total.possible && total.weight > 0)
+                res.effectiveSamples = total.weight * total.weight / total.weightSquares;
+
+            if (query.dense) {
+                res.cells.resize(query.cells);
+                S::iota(res.cells.begin(), res.cells.end(), uint64_t{0});
+                res.value.assign(total.sums.begin() + query.offset, total.sums.begin() + query.offset + query.cells);
+            } else {
+                auto merged = HashedCells();
+                for (const auto &w : workers)
+                    if (w.value.counts.possible && !w.value.hashed.empty()) {
+                        const auto f{S::exp(w.value.counts.shift - total.shift)};
+                        w.value.hashed[q].forEach([&](uint64_t cell, double weight) { merged.add(cell, weight * f); });
+                    }
+                auto entries = S::vector<S::pair<uint64_t, double>>();
+                merged.forEach([&](uint64_t cell, double weight) { entries.emplace_back(cell, weight); });
+                S::sort(entries.begin(), entries.end());
+                for (const auto &[cell, weight] : entries) {
+                    res.cells.push_back(cell);
+                    res.value.push_back(weight);
+                }
+            }
+
+            // Normalizes the cells of each configuration of the given nodes, which are contiguous.
+            for (size_t first{0}; first < res.cells.size();) {
+                const auto configuration{res.cells[first] / query.targetCells};
+                auto last{first};
+                auto sum{0.0};
+                for (; last < res.cells.size() && res.cells[last] / query.targetCells == configuration; last++)
+                    sum += res.value[last];
+                for (auto k{first}; k < last; k++) res.value[k] = sum > 0 ? res.value[k] / sum : 0.0;
+                first = last;
+            }
+            results.push_back(S::move(res));
+        }
+        return results;
+    }
+
+    S::vector<JointResult> sample(const Evidence &evidence, size_t samples, uint64_t seed) {
+        return sample(evidence, samples, CounterSampler{seed});
+    }
+};
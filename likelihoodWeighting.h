@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "threadPool.h"
+#include "compiledNetwork.h"
+#include "marginals.h"
+#include "networkSampler.h"
+
+namespace S = std;
+
+// Posterior marginals of the target compiled nodes given evidence, by likelihood weighting over the particles of
+// the seed; unlikely evidence leaves few effective samples.
+inline PosteriorResult likelihoodWeighting(NetworkSampler &sampler, const S::vector<size_t> &targets,
+                                           const Evidence &evidence, size_t samples, uint64_t seed) {
+    const auto s{CounterSampler{seed}};
+    auto offsets = S::vector<size_t>{0};
+    for (const auto n : targets) offsets.push_back(offsets.back() + sampler.network.arity[n]);
+    auto counts = S::vector<Padded<WeightedCounts>>(sampler.pool.size());
+
+    sampler.forEachWeightedTile(0, samples, s, evidence, [&](size_t worker, size_t, NodeMajorView<State> states,
+                                                             const float *logWeights) {
+        auto &c{counts[worker].value};
+        if (c.sums.empty()) c.sums.resize(offsets.back());
+        c.add({states.data, states.ld, states.count}, logWeights, targets, offsets);
+    });
+
+    WeightedCounts total;
+    for (const auto &c : counts) total.merge(c.value);
+    return total.result(offsets.back());
+}
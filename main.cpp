@@ -1,6 +1,7 @@
 #include "lib/smile_license.h"
 #include "MCIntegrator.h"
 #include "networkLoader.h"
+#include "benchmarks.h"
 
 int main(int argc, char *argv[]) {
     std::cout << "--- Start ---\n\n";
@@ -41,6 +42,14 @@ int main(int argc, char *argv[]) {
     double nextLap = t.getLap();
     std::cout << "---Next--- Samples per second: [millions]" << 1.0 * randSamples / nextLap / 1000 << '\n';
 
+    benchmarkUniforms();
+    benchmarkIntegrators();
+    benchmarkRowSelection();
+    benchmarkRqmc();
+    benchmarkSequential();
+    benchmarkVegas();
+    if (argc > 1) benchmarkRawDraws(argv[1]);
+
     return 0;
 }
 
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <cmath>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#include "threadPool.h"
+#include "stoppingRule.h"
+#include "compiledNetwork.h"
+
+namespace S = std;
+
+// Totals written by one worker and read by any thread through a seqlock: read() always returns one whole
+// publication, and publish() never waits for readers.
+template<typename T>
+struct alignas(cacheLine) Publication {
+    S::atomic<uint64_t> sequence{0};
+    size_t size{0};
+    // Each rounded up to whole cache lines, so no other worker's data shares a line with them.
+    AlignedVector<T> totals;
+    AlignedVector<S::atomic<T>> published;
+
+    void resize(size_t size) {
+        this->size = size;
+        const auto lines{(size * sizeof(T) + cacheLine - 1) / cacheLine};
+        totals.assign(lines * cacheLine / sizeof(T), T{});
+        published = AlignedVector<S::atomic<T>>(lines * cacheLine / sizeof(T));
+    }
+
+    void publish() {
+        const auto s{sequence.load(S::memory_order_relaxed)};
+        sequence.store(s + 1, S::memory_order_relaxed);
+        S::atomic_thread_fence(S::memory_order_release);
+        for (size_t k{0}; k < size; k++) published[k].store(totals[k], S::memory_order_relaxed);
+        sequence.store(s + 2, S::memory_order_release);
+    }
+
+    void read(T *out) const {
+        for (;;) {
+            const auto before{sequence.load(S::memory_order_acquire)};
+            for (size_t k{0}; k < size; k++) out[k] = published[k].load(S::memory_order_relaxed);
+            S::atomic_thread_fence(S::memory_order_acquire);
+            if (!(before & 1) && sequence.load(S::memory_order_relaxed) == before) return;
+        }
+    }
+};
+
+struct Interval {
+    double lower{0};
+    double upper{1};
+};
+
+// Marginals of a set of target nodes at one point of a run.
+struct MarginalSnapshot {
+    // Probability of every state of the target nodes, the states of each node in turn.
+    S::vector<double> value;
+    // Variance of each value as an estimate.
+    S::vector<double> variance;
+    size_t samples{0};
+    // Kish's effective sample size; samples when unweighted.
+    double effectiveSamples{0};
+
+    // Wilson score interval of value[k], at the sample size whose binomial variance is variance[k].
+    [[nodiscard]] Interval interval(size_t k, double confidence = 0.95) const {
+        const auto z{normalQuantile(0.5 + confidence / 2)};
+        const auto p{value[k]};
+        const auto n{variance[k] > 0 ? p * (1 - p) / variance[k] : effectiveSamples};
+        if (n <= 0) return {};
+        const auto z2{z * z / n};
+        const auto centre{(p + z2 / 2) / (1 + z2)};
+        const auto half{z / (1 + z2) * S::sqrt(p * (1 - p) / n + z2 / (4 * n))};
+        // Exact at the ends, where rounding leaves centre - half a hair above 0.
+        return {p > 0 ? S::max(centre - half, 0.0) : 0.0, p < 1 ? S::min(centre + half, 1.0) : 1.0};
+    }
+};
+
+// Per-worker state histograms of target nodes; snapshot() may run on any thread, even while workers add.
+struct MarginalCounts {
+    S::vector<size_t> nodes;
+    S::vector<size_t> offsets;
+    // Per worker, the count of every state of the nodes and then the number of particles.
+    S::vector<Publication<uint64_t>> workers;
+
+    MarginalCounts(const CompiledNetwork &network, const S::vector<size_t> &nodes, size_t workerCount) :
+            nodes(nodes), offsets{0}, workers(workerCount) {
+        for (const auto n : nodes) offsets.push_back(offsets.back() + network.arity[n]);
+        for (auto &w : workers) w.resize(offsets.back() + 1);
+    }
+
+    [[nodiscard]] size_t states() const { return offsets.back(); }
+
+    // Counts a tile of particles into worker's block; only that worker may add to it.
+    void add(size_t worker, NodeMajorView<const State> particles) {
+        auto &totals{workers[worker].totals};
+        for (size_t q{0}; q < nodes.size(); q++) {
+            const auto row{particles.row(nodes[q])};
+            const auto counters{totals.data() + offsets[q]};
+            for (size_t i{0}; i < particles.count; i++) counters[row[i]]++;
+        }
+        totals[states()] += particles.count;
+        workers[worker].publish();
+    }
+
+    // Published counts of every state summed over the workers, followed by the number of particles.
+    [[nodiscard]] S::vector<uint64_t> totals() const {
+        auto sum = S::vector<uint64_t>(states() + 1), block = S::vector<uint64_t>(states() + 1);
+        for (const auto &w : workers) {
+            w.read(block.data());
+            for (size_t k{0}; k < sum.size(); k++) sum[k] += block[k];
+        }
+        return sum;
+    }
+
+    [[nodiscard]] MarginalSnapshot snapshot() const {
+        const auto counts{totals()};
+        const auto n{counts.back()};
+        MarginalSnapshot res{S::vector<double>(states()), S::vector<double>(states()), n, static_cast<double>(n)};
+        if (n == 0) return res;
+        for (size_t k{0}; k < states(); k++) {
+            const auto p{static_cast<double>(counts[k]) / n};
+            res.value[k] = p;
+            res.variance[k] = p * (1 - p) / n;
+        }
+        return res;
+    }
+};
+
+struct PosteriorResult {
+    // Posterior probability of every state of the target nodes, the states of each node in turn.
+    S::vector<double> value;
+    size_t samples{0};
+    // Kish's effective sample size; 0 when no particle was consistent with the evidence.
+    double effectiveSamples{0};
+    // Estimate of log P(evidence); CompiledNetwork::logZero when no particle was consistent with it.
+    double logEvidence{CompiledNetwork::logZero};
+};
+
+// Weighted state counts of particles with log weights, kept relative to exp(shift), the largest log weight seen.
+struct WeightedCounts {
+    S::vector<double> sums;
+    // Squared weight sums laid out like sums; kept only when sized like it.
+    S::vector<double> squares;
+    double weight{0};
+    double weightSquares{0};
+    double shift{0};
+    size_t samples{0};
+    // False until a particle consistent with the evidence is seen; shift is meaningless before.
+    bool possible{false};
+    S::vector<double> tileWeights;
+
+    void shiftTo(double s) {
+        if (possible) {
+            const auto f{S::exp(shift - s)};
+            for (auto &x : sums) x *= f;
+            for (auto &x : squares) x *= f * f;
+            weight *= f;
+            weightSquares *= f * f;
+        }
+        shift = s;
+        possible = true;
+    }
+
+    // Adds a tile's weights to the totals and leaves them in tileWeights; false when all of them are zero.
+    bool weigh(const float *logWeights, size_t count) {
+        samples += count;
+        const auto top{*S::max_element(logWeights, logWeights + count)};
+        if (top <= CompiledNetwork::logZero / 2) return false;
+        if (!possible || top > shift) shiftTo(top);
+
+        tileWeights.resize(count);
+        for (size_t i{0}; i < count; i++) {
+            const auto w{S::exp(static_cast<double>(logWeights[i]) - shift)};
+            tileWeights[i] = w;
+            weight += w;
+            weightSquares += w * w;
+        }
+        return true;
+    }
+
+    // Adds a tile of particles; node q of nodes counts into sums from offsets[q].
+    void add(NodeMajorView<const State> states, const float *logWeights, const S::vector<size_t> &nodes,
+             const S::vector<size_t> &offsets) {
+        if (!weigh(logWeights, states.count)) return;
+        for (size_t q{0}; q < nodes.size(); q++) {
+            const auto row{states.row(nodes[q])};
+            const auto counters{sums.data() + offsets[q]};
+            for (size_t i{0}; i < states.count; i++) counters[row[i]] += tileWeights[i];
+            if (squares.empty()) continue;
+            const auto squared{squares.data() + offsets[q]};
+            for (size_t i{0}; i < states.count; i++) squared[row[i]] += tileWeights[i] * tileWeights[i];
+        }
+    }
+
+    void merge(const WeightedCounts &other) {
+        samples += other.samples;
+        if (!other.possible) return;
+        if (!possible || other.shift > shift) shiftTo(other.shift);
+        const auto f{S::exp(other.shift - shift)};
+        if (sums.size() < other.sums.size()) sums.resize(other.sums.size());
+        for (size_t k{0}; k < other.sums.size(); k++) sums[k] += other.sums[k] * f;
+        if (squares.size() < other.squares.size()) squares.resize(other.squares.size());
+        for (size_t k{0}; k < other.squares.size(); k++) squares[k] += other.squares[k] * f * f;
+        weight += other.weight * f;
+        weightSquares += other.weightSquares * f * f;
+    }
+
+    [[nodiscard]] PosteriorResult result(size_t states) const {
+        PosteriorResult res{S::vector<double>(states), samples};
+        if (!possible || weight <= 0) return res;
+        for (size_t k{0}; k < states; k++) res.value[k] = sums[k] / weight;
+        res.effectiveSamples = weight * weight / weightSquares;
+        res.logEvidence = shift + S::log(weight / samples);
+        return res;
+    }
+};
+
+// Per-worker WeightedCounts of target nodes, published like MarginalCounts.
+struct WeightedMarginals {
+    S::vector<size_t> nodes;
+    S::vector<size_t> offsets;
+    // Only worker w adds to counts[w].
+    S::vector<Padded<WeightedCounts>> counts;
+    // Per worker: the sums of its counts, then their squares, then the slots below.
+    S::vector<Publication<double>> workers;
+
+    enum Slot : size_t { weight, weightSquares, shift, samples, possible, slots };
+
+    WeightedMarginals(const CompiledNetwork &network, const S::vector<size_t> &nodes, size_t workerCount) :
+            nodes(nodes), offsets{0}, counts(workerCount), workers(workerCount) {
+        for (const auto n : nodes) offsets.push_back(offsets.back() + network.arity[n]);
+        for (auto &c : counts) c.value.sums.resize(states()), c.value.squares.resize(states());
+        for (auto &w : workers) w.resize(2 * states() + slots);
+    }
+
+    [[nodiscard]] size_t states() const { return offsets.back(); }
+
+    // Adds a tile of particles and their log weights to worker's counts; only that worker may add to them.
+    void add(size_t worker, NodeMajorView<const State> particles, const float *logWeights) {
+        auto &c{counts[worker].value};
+        c.add(particles, logWeights, nodes, offsets);
+        const auto block{workers[worker].totals.data()};
+        S::copy(c.sums.begin(), c.sums.end(), block);
+        S::copy(c.squares.begin(), c.squares.end(), block + states());
+        const auto slot{block + 2 * states()};
+        slot[weight] = c.weight;
+        slot[weightSquares] = c.weightSquares;
+        slot[shift] = c.shift;
+        slot[samples] = static_cast<double>(c.samples);
+        slot[possible] = c.possible;
+        workers[worker].publish();
+    }
+
+    // Published counts of all workers, merged.
+    [[nodiscard]] WeightedCounts totals() const {
+        WeightedCounts sum, worker;
+        auto block = S::vector<double>(2 * states() + slots);
+        const auto slot{block.data() + 2 * states()};
+        for (const auto &w : workers) {
+            w.read(block.data());
+            worker.sums.assign(block.data(), block.data() + states());
+            worker.squares.assign(block.data() + states(), slot);
+            worker.weight = slot[weight];
+            worker.weightSquares = slot[weightSquares];
+            worker.shift = slot[shift];
+            worker.samples = static_cast<size_t>(slot[samples]);
+            worker.possible = slot[possible] != 0;
+            sum.merge(worker);
+        }
+        return sum;
+    }
+
+    [[nodiscard]] MarginalSnapshot snapshot() const {
+        const auto sum{totals()};
+        MarginalSnapshot res{S::vector<double>(states()), S::vector<double>(states()), sum.samples};
+        if (!sum.possible || sum.weight <= 0) return res;
+        const auto w{sum.weight}, w2{sum.weightSquares};
+        res.effectiveSamples = w * w / w2;
+        for (size_t k{0}; k < states(); k++) {
+            const auto p{sum.sums[k] / w};
+            res.value[k] = p;
+            res.variance[k] = S::max(sum.squares[k] * (1 - 2 * p) + p * p * w2, 0.0) / (w * w);
+        }
+        return res;
+    }
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cmath>
+#include <cstdint>
 #include <string>
 #include <iostream>
 #include <utility>
@@ -23,10 +25,22 @@ namespace B = boost;
 namespace T = tinyxml2;
 namespace S = std;
 
+struct AliasSlot {
+    float prob;
+    uint32_t alias;
+    // prob scaled to 2^32, compared against the low bits of a raw 32-bit draw.
+    uint32_t threshold;
+};
+
 struct CumulativeCpt {
+    // Rows with at least this many states are drawn through a Walker alias table.
+    static constexpr size_t aliasMinArity{32};
+
     S::vector<size_t> pRadix;
     size_t lineSize{0};
     S::vector<float> cumulativeCpt;
+    S::vector<uint32_t> thresholds;
+    S::vector<AliasSlot> aliasTable;
 
     static S::vector<size_t> getRadix(const S::vector<size_t> &parentStatusSizes, size_t total) {
         return partial_reduce(S::divides<>(), total, parentStatusSizes);
@@ -38,9 +52,87 @@ struct CumulativeCpt {
         return cpt;
     }
 
-    size_t getState(const S::vector<size_t> &pStatus, const float sample) {
-        const auto line{cumulativeCpt.begin() + B::inner_product(pStatus, pRadix, size_t{})};
+    static uint32_t toThreshold(double prob) { return static_cast<uint32_t>(S::min(S::round(prob * 0x1p32), 0x1p32 - 1)); }
+
+    // Cumulative rows scaled to 2^32 and rounded, so a raw 32-bit draw selects a state exactly to 2^-32.
+    [[nodiscard]] S::vector<uint32_t> getThresholds(const S::vector<float> &cpt) const {
+        auto res = S::vector<uint32_t>(cpt.size());
+        for (size_t line{0}; line < cpt.size(); line += lineSize) {
+            const auto total{S::accumulate(cpt.begin() + line, cpt.begin() + line + lineSize, 0.0)};
+            auto cumulative{0.0};
+            for (size_t s{0}; s < lineSize; s++) {
+                cumulative += cpt[line + s];
+                res[line + s] = toThreshold(cumulative / total);
+            }
+        }
+        return res;
+    }
+
+    // Vose's construction, one independent table per CPT line.
+    static S::vector<AliasSlot> getAliasTable(const S::vector<float> &cpt, size_t lineSize) {
+        auto table = S::vector<AliasSlot>(cpt.size());
+        S::vector<size_t> small, large;
+        auto scaled = S::vector<double>(lineSize);
+
+        for (size_t line{0}; line < cpt.size(); line += lineSize) {
+            const auto total{S::accumulate(cpt.begin() + line, cpt.begin() + line + lineSize, 0.0)};
+            for (size_t s{0}; s < lineSize; s++) {
+                scaled[s] = cpt[line + s] * lineSize / total;
+                (scaled[s] < 1.0 ? small : large).push_back(s);
+            }
+            while (!small.empty() && !large.empty()) {
+                const auto l{small.back()}, g{large.back()};
+                small.pop_back();
+                table[line + l] = {static_cast<float>(scaled[l]), static_cast<uint32_t>(g), toThreshold(scaled[l])};
+                scaled[g] -= 1.0 - scaled[l];
+                if (scaled[g] < 1.0) {
+                    large.pop_back();
+                    small.push_back(g);
+                }
+            }
+            // Whatever is left is 1 up to rounding.
+            for (const auto s : small) table[line + s] = {1.0f, static_cast<uint32_t>(s), toThreshold(1.0)};
+            for (const auto s : large) table[line + s] = {1.0f, static_cast<uint32_t>(s), toThreshold(1.0)};
+            small.clear();
+            large.clear();
+        }
+        return table;
+    }
+
+    static size_t getCumulativeState(const float *line, size_t lineSize, const float sample) {
         return S::upper_bound(line, line + lineSize, sample) - line;
+    }
+
+    static size_t getAliasState(const AliasSlot *line, size_t lineSize, const float sample) {
+        const auto scaled{sample * lineSize};
+        const auto slot{S::min(static_cast<size_t>(scaled), lineSize - 1)};
+        return scaled - slot < line[slot].prob ? slot : line[slot].alias;
+    }
+
+    // The last threshold is implicitly 2^32, so only the first lineSize - 1 are searched.
+    static size_t getThresholdState(const uint32_t *line, size_t lineSize, const uint32_t draw) {
+        return S::upper_bound(line, line + lineSize - 1, draw) - line;
+    }
+
+    // The high bits of draw * lineSize pick the slot, the low 32 bits are the uniform within it.
+    static size_t getAliasState(const AliasSlot *line, size_t lineSize, const uint32_t draw) {
+        const auto scaled{uint64_t{draw} * lineSize};
+        const auto slot{scaled >> 32};
+        return static_cast<uint32_t>(scaled) < line[slot].threshold ? slot : line[slot].alias;
+    }
+
+    size_t getState(const S::vector<size_t> &pStatus, const uint32_t draw) {
+        const auto offset{B::inner_product(pStatus, pRadix, size_t{})};
+        return aliasTable.empty()
+               ? getThresholdState(thresholds.data() + offset, lineSize, draw)
+               : getAliasState(aliasTable.data() + offset, lineSize, draw);
+    };
+
+    size_t getState(const S::vector<size_t> &pStatus, const float sample) {
+        const auto offset{B::inner_product(pStatus, pRadix, size_t{})};
+        return aliasTable.empty()
+               ? getCumulativeState(cumulativeCpt.data() + offset, lineSize, sample)
+               : getAliasState(aliasTable.data() + offset, lineSize, sample);
     };
 
     CumulativeCpt() = default;
@@ -48,7 +140,9 @@ struct CumulativeCpt {
     CumulativeCpt(const S::vector<float> &cpt, const S::vector<size_t> &parentStatusSizes) :
             pRadix(getRadix(parentStatusSizes, cpt.size())),
             lineSize(pRadix.empty() ? cpt.size() : pRadix.back()),
-            cumulativeCpt(getCumulativeCPT(cpt)) {}
+            cumulativeCpt(getCumulativeCPT(cpt)),
+            thresholds(getThresholds(cpt)),
+            aliasTable(lineSize >= aliasMinArity ? getAliasTable(cpt, lineSize) : S::vector<AliasSlot>{}) {}
 };
 
 struct RawNode {
@@ -61,6 +155,7 @@ struct RawNode {
     CumulativeCpt cumulativeCpt;
 
     size_t depth{0};
+    size_t index{0};
 
     explicit RawNode(T::XMLElement *node) :
             id(getAttrId(node)),
@@ -71,9 +166,11 @@ struct RawNode {
 
 struct BN_Network {
     S::vector<RawNode *> nodes;
+    size_t numSamples{0};
 
-    explicit BN_Network(const S::string &name) {
+    explicit BN_Network(const S::string &name) : numSamples(getNumSamples(name)) {
         nodes = map([](auto node) { return new RawNode{node}; }, getXmlNodes(name));
+        for (size_t i{0}; i < nodes.size(); i++) nodes[i]->index = i;
         setParents();
         setLayers();
         setCumulativeCPTs();
@@ -119,13 +216,10 @@ struct BN_Network {
         }
     }
 
-    void sample(S::vector<size_t> inputSample, S::vector<size_t> nodeStates) const {
-        std::random_device rd;
-        std::uniform_real_distribution<> dist{0.0, 1.0};
-
+    void sample(const S::vector<float> &inputSample, S::vector<size_t> &nodeStates) const {
         auto nodeIterator = nodeStates.begin();
         auto inputSampleIterator = inputSample.begin();
-        const auto getPStates = [&](const auto p) { return nodeStates.at(p - nodes[0]); };
+        const auto getPStates = [&](const auto p) { return nodeStates.at(p->index); };
 
         for (const auto n : nodes)
             *nodeIterator++ = n->cumulativeCpt.getState(map(getPStates, n->parents), *inputSampleIterator++);
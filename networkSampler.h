@@ -0,0 +1,342 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cassert>
+#include <type_traits>
+
+#include "rng.h"
+#include "sobol.h"
+#include "stratification.h"
+#include "stoppingRule.h"
+#include "marginals.h"
+#include "packedParticles.h"
+#include "threadPool.h"
+#include "compiledNetwork.h"
+
+namespace S = std;
+
+// Samples particles of a CompiledNetwork on a ThreadPool. Particle i of a seed gets the uniforms
+// CounterSampler{seed}.at(i, n), so a seed yields the same particles for any pool size. Networks compiled with
+// integer thresholds are sampled from the raw 32-bit draws behind those uniforms instead.
+struct NetworkSampler {
+    static constexpr size_t chunk{CompiledNetwork::batchTile * 4};
+    // Nodes whose uniforms come from one Philox block.
+    static constexpr size_t uniformBlock{4};
+
+    const CompiledNetwork &network;
+    ThreadPool &pool;
+    const NumaReplicas<CompiledNetwork> *replicas{nullptr};
+    S::vector<Padded<AlignedVector<float>>> uniforms;
+    S::vector<Padded<AlignedVector<uint32_t>>> draws;
+    S::vector<Padded<AlignedVector<State>>> stateTiles;
+    S::vector<Padded<AlignedVector<float>>> logWeightTiles;
+
+    explicit NetworkSampler(const CompiledNetwork &network, ThreadPool &pool = ThreadPool::global()) :
+            network(network), pool(pool), uniforms(pool.size()), draws(pool.size()),
+            stateTiles(pool.size()),
+            logWeightTiles(pool.size()) {}
+
+    NetworkSampler(const NumaReplicas<CompiledNetwork> &replicas, ThreadPool &pool) :
+            network(replicas.local(0)), pool(pool), replicas(&replicas), uniforms(pool.size()), draws(pool.size()),
+            stateTiles(pool.size()),
+            logWeightTiles(pool.size()) {}
+
+    [[nodiscard]] const CompiledNetwork &localNetwork(size_t worker) const {
+        return replicas ? replicas->local(pool.numaNode(worker)) : network;
+    }
+
+    // Per-worker uniform tile, allocated by the worker itself.
+    [[nodiscard]] float *uniformTile(size_t worker) {
+        auto &tile{uniforms[worker].value};
+        if (tile.empty()) tile.resize(network.size() * chunk);
+        return tile.data();
+    }
+
+    [[nodiscard]] uint32_t *drawTile(size_t worker) {
+        auto &tile{draws[worker].value};
+        if (tile.empty()) tile.resize(network.size() * chunk);
+        return tile.data();
+    }
+
+    // Tile of count particles of the type the network samples from: float uniforms, or raw draws.
+    template<typename U>
+    [[nodiscard]] NodeMajorView<U> inputTile(size_t worker, size_t count) {
+        if constexpr (S::is_same_v<U, float>) return {uniformTile(worker), chunk, count};
+        else return {drawTile(worker), chunk, count};
+    }
+
+    // Calls fn(U{}) with U = uint32_t when the network has integer thresholds, and float otherwise.
+    template<typename Function>
+    void withInputType(Function &&fn) const {
+        if (network.thresholdArena.empty()) fn(float{});
+        else fn(uint32_t{});
+    }
+
+    [[nodiscard]] State *stateTile(size_t worker) {
+        auto &tile{stateTiles[worker].value};
+        if (tile.empty()) tile.resize(network.size() * chunk);
+        return tile.data();
+    }
+
+    [[nodiscard]] float *logWeightTile(size_t worker) {
+        auto &tile{logWeightTiles[worker].value};
+        if (tile.empty()) tile.resize(chunk);
+        return tile.data();
+    }
+
+    [[nodiscard]] size_t chunks(size_t particles) const { return (particles + chunk - 1) / chunk; }
+
+    // Uniforms of nodes [firstNode, lastNode) of particles [first, first + tile.count) into a node-major tile;
+    // firstNode must be a multiple of uniformBlock.
+    void fillUniforms(const CounterSampler &s, size_t first, NodeMajorView<float> tile, size_t firstNode,
+                      size_t lastNode) const {
+        for (size_t i{0}; i < tile.count; i++)
+            for (auto n{firstNode}; n < lastNode; n += uniformBlock) {
+                const auto block{s.bits(first + i, n / uniformBlock)};
+                for (size_t w{0}; w < uniformBlock && n + w < lastNode; w++) tile.row(n + w)[i] = uniformFloat(block[w]);
+            }
+    }
+
+    // The raw draws behind the uniforms of the float overload.
+    void fillUniforms(const CounterSampler &s, size_t first, NodeMajorView<uint32_t> tile, size_t firstNode,
+                      size_t lastNode) const {
+        for (size_t i{0}; i < tile.count; i++)
+            for (auto n{firstNode}; n < lastNode; n += uniformBlock) {
+                const auto block{s.bits(first + i, n / uniformBlock)};
+                for (size_t w{0}; w < uniformBlock && n + w < lastNode; w++) tile.row(n + w)[i] = block[w];
+            }
+    }
+
+    template<typename U>
+    void fillUniforms(const SobolSampler &s, size_t first, NodeMajorView<U> tile, size_t firstNode,
+                      size_t lastNode) const {
+        for (auto n{firstNode}; n < lastNode; n++) s.fillDimension(first, n, tile.row(n), tile.count);
+    }
+
+    template<typename U>
+    void fillUniforms(const StratifiedSampler &s, size_t first, NodeMajorView<U> tile, size_t firstNode,
+                      size_t lastNode) const {
+        for (auto n{firstNode}; n < lastNode; n += uniformBlock)
+            s.fillBlock(first, n / uniformBlock, tile.row(n), tile.ld, S::min(uniformBlock, lastNode - n), tile.count);
+    }
+
+    template<typename Source, typename U>
+    void fillUniforms(const Source &s, size_t first, NodeMajorView<U> tile) const {
+        fillUniforms(s, first, tile, 0, network.size());
+    }
+
+    // Runs fn(worker, first, states) for every chunk of particles once its states have been sampled; s is a
+    // CounterSampler or a SobolSampler.
+    template<typename Source, typename Function> requires (!S::is_integral_v<Source>)
+    void forEachChunk(NodeMajorView<State> states, const Source &s, Function &&fn) {
+        withInputType([&]<typename U>(U) {
+            pool.parallelFor(chunks(states.count), [&](size_t worker, size_t c) {
+                const auto first{c * chunk}, last{S::min(first + chunk, states.count)};
+                const auto tile{inputTile<U>(worker, last - first)};
+                fillUniforms(s, first, tile);
+                const auto chunkStates{states.columns(first, last)};
+                localNetwork(worker).sampleBatch(NodeMajorView<const U>{tile.data, tile.ld, tile.count}, chunkStates);
+                fn(worker, first, chunkStates);
+            });
+        });
+    }
+
+    template<typename Function>
+    void forEachChunk(NodeMajorView<State> states, uint64_t seed, Function &&fn) {
+        forEachChunk(states, CounterSampler{seed}, fn);
+    }
+
+    // Like forEachChunk for particles [first, first + count), but each chunk is sampled into a per-worker tile
+    // that fn must consume before returning, for callers that only keep statistics of the particles.
+    template<typename Source, typename Function>
+    void forEachTile(size_t first, size_t count, const Source &s, Function &&fn) {
+        withInputType([&]<typename U>(U) {
+            pool.parallelFor(chunks(count), [&](size_t worker, size_t c) {
+                const auto begin{first + c * chunk}, end{S::min(begin + chunk, first + count)};
+                const auto tile{inputTile<U>(worker, end - begin)};
+                fillUniforms(s, begin, tile);
+                const auto tileStates{NodeMajorView<State>{stateTile(worker), chunk, end - begin}};
+                localNetwork(worker).sampleBatch(NodeMajorView<const U>{tile.data, tile.ld, tile.count}, tileStates);
+                fn(worker, begin, tileStates);
+            });
+        });
+    }
+
+    // forEachTile with the evidence clamped: fn(worker, first, states, logWeights) also gets the log likelihood
+    // of the evidence for every particle of the tile, in a per-worker buffer fn may modify.
+    template<typename Source, typename Function>
+    void forEachWeightedTile(size_t first, size_t count, const Source &s, const Evidence &evidence, Function &&fn) {
+        withInputType([&]<typename U>(U) {
+            pool.parallelFor(chunks(count), [&](size_t worker, size_t c) {
+                const auto begin{first + c * chunk}, end{S::min(begin + chunk, first + count)};
+                const auto tile{inputTile<U>(worker, end - begin)};
+                fillUniforms(s, begin, tile);
+                const auto tileStates{NodeMajorView<State>{stateTile(worker), chunk, end - begin}};
+                const auto logWeights{logWeightTile(worker)};
+                localNetwork(worker).sampleBatch(NodeMajorView<const U>{tile.data, tile.ld, tile.count}, tileStates,
+                                                 evidence.data(), logWeights);
+                fn(worker, begin, tileStates, logWeights);
+            });
+        });
+    }
+
+    // forEachTile for rejection sampling: fn(worker, first, states, nodeSamples) gets the particles of the chunk
+    // that match the evidence, and the node states drawn to find them.
+    template<typename Source, typename Function>
+    void forEachAcceptedTile(size_t first, size_t count, const Source &s, const Evidence &evidence, Function &&fn) {
+        withInputType([&]<typename U>(U) {
+            pool.parallelFor(chunks(count), [&](size_t worker, size_t c) {
+                const auto begin{first + c * chunk}, end{S::min(begin + chunk, first + count)};
+                const auto tile{inputTile<U>(worker, end - begin)};
+                const auto fill = [&](size_t n, size_t column, size_t columns) {
+                    if (n % uniformBlock) return;
+                    const auto last{S::min(n + uniformBlock, network.size())};
+                    fillUniforms(s, begin + column, tile.columns(column, column + columns), n, last);
+                };
+                auto tileStates{NodeMajorView<State>{stateTile(worker), chunk, end - begin}};
+                size_t nodeSamples{0};
+                tileStates.count = localNetwork(worker).sampleRejecting(
+                        NodeMajorView<const U>{tile.data, tile.ld, tile.count}, tileStates, evidence.data(),
+                        nodeSamples, fill);
+                fn(worker, begin, tileStates, nodeSamples);
+            });
+        });
+    }
+
+    // Samples particles [first, first + count) into the histograms of marginals, which other threads may
+    // snapshot meanwhile; the particles themselves are never stored.
+    template<typename Source>
+    void accumulate(MarginalCounts &marginals, size_t first, size_t count, const Source &s) {
+        forEachTile(first, count, s, [&](size_t worker, size_t, NodeMajorView<State> tileStates) {
+            marginals.add(worker, {tileStates.data, tileStates.ld, tileStates.count});
+        });
+    }
+
+    // accumulate with the evidence clamped, each particle weighted by its likelihood.
+    template<typename Source>
+    void accumulate(WeightedMarginals &marginals, const Evidence &evidence, size_t first, size_t count,
+                    const Source &s) {
+        forEachWeightedTile(first, count, s, evidence, [&](size_t worker, size_t, NodeMajorView<State> tileStates,
+                                                           const float *logWeights) {
+            marginals.add(worker, {tileStates.data, tileStates.ld, tileStates.count}, logWeights);
+        });
+    }
+
+    // Marginals of the given compiled nodes, sampled until every state's probability meets rule or the cap, by
+    // default the network's numsamples, is reached. value and halfWidth list the states of each node in turn.
+    SequentialResult sampleMarginals(const S::vector<size_t> &nodes, const StoppingRule &rule, uint64_t seed) {
+        const auto s{CounterSampler{seed}};
+        const auto z{rule.z()};
+        auto marginals = MarginalCounts(network, nodes, pool.size());
+        auto totals = S::vector<uint64_t>(marginals.states() + 1);
+
+        const auto halfWidth = [&](size_t k, size_t n) {
+            const auto centre{(totals[k] + z * z / 2) / (n + z * z)};
+            return z * S::sqrt(centre * (1 - centre) / n);
+        };
+
+        const auto [samples, converged] = rule.run(rule.cap(network.numSamples), [&](size_t first, size_t count) {
+            accumulate(marginals, first, count, s);
+        }, [&](size_t n) {
+            totals = marginals.totals();
+            auto worst{0.0};
+            for (size_t k{0}; k < marginals.states(); k++)
+                worst = S::max(worst, rule.ratio(halfWidth(k, n), static_cast<double>(totals[k]) / n));
+            return worst;
+        });
+
+        SequentialResult result{{}, {}, samples, converged};
+        for (size_t k{0}; k < marginals.states(); k++) {
+            result.value.push_back(samples ? static_cast<double>(totals[k]) / samples : 0.0);
+            result.halfWidth.push_back(samples ? halfWidth(k, samples) : 0.0);
+        }
+        return result;
+    }
+
+    // sampleMarginals on the correlated uniforms of s, in whole batches, with intervals from the spread of the
+    // batch means.
+    SequentialResult sampleMarginals(const S::vector<size_t> &nodes, const StoppingRule &rule,
+                                     const StratifiedSampler &s) {
+        assert(chunk % s.batch == 0);
+        // Per worker: state counts, their sums of squared per-batch counts, and the current batch's counts.
+        struct BatchCounts {
+            S::vector<uint64_t> counts;
+            S::vector<uint64_t> squares;
+            S::vector<uint32_t> batch;
+        };
+        const auto z{rule.z()};
+        auto offsets = S::vector<size_t>{0};
+        for (const auto n : nodes) offsets.push_back(offsets.back() + network.arity[n]);
+        auto counts = S::vector<Padded<BatchCounts>>(pool.size());
+        auto totals = S::vector<uint64_t>(offsets.back()), squares = S::vector<uint64_t>(offsets.back());
+
+        const auto halfWidth = [&](size_t k, size_t n) {
+            if (totals[k] == 0) {
+                const auto centre{z * z / 2 / (n + z * z)};
+                return z * S::sqrt(centre * (1 - centre) / n);
+            }
+            const auto batches{static_cast<double>(n / s.batch)}, m{static_cast<double>(s.batch)};
+            const auto mean{static_cast<double>(totals[k]) / n};
+            const auto spread{S::max(static_cast<double>(squares[k]) / (m * m) - batches * mean * mean, 0.0)};
+            return z * S::sqrt(spread / S::max(batches - 1, 1.0) / batches);
+        };
+
+        const auto [samples, converged] = rule.run(rule.cap(network.numSamples), [&](size_t first, size_t count) {
+            forEachTile(first, count, s, [&](size_t worker, size_t, NodeMajorView<State> tileStates) {
+                auto &c{counts[worker].value};
+                if (c.counts.empty()) {
+                    c.counts.resize(offsets.back());
+                    c.squares.resize(offsets.back());
+                }
+                for (size_t q{0}; q < nodes.size(); q++) {
+                    const auto row{tileStates.row(nodes[q])};
+                    const auto arity{offsets[q + 1] - offsets[q]};
+                    for (size_t b{0}; b < tileStates.count; b += s.batch) {
+                        c.batch.assign(arity, 0);
+                        for (size_t i{0}; i < s.batch; i++) c.batch[row[b + i]]++;
+                        for (size_t x{0}; x < arity; x++) {
+                            c.counts[offsets[q] + x] += c.batch[x];
+                            c.squares[offsets[q] + x] += uint64_t{c.batch[x]} * c.batch[x];
+                        }
+                    }
+                }
+            });
+        }, [&](size_t n) {
+            S::fill(totals.begin(), totals.end(), 0);
+            S::fill(squares.begin(), squares.end(), 0);
+            for (const auto &c : counts)
+                for (size_t k{0}; k < c.value.counts.size(); k++) {
+                    totals[k] += c.value.counts[k];
+                    squares[k] += c.value.squares[k];
+                }
+            auto worst{0.0};
+            for (size_t k{0}; k < totals.size(); k++)
+                worst = S::max(worst, rule.ratio(halfWidth(k, n), static_cast<double>(totals[k]) / n));
+            return worst;
+        }, s.batch);
+
+        SequentialResult result{{}, {}, samples, converged};
+        for (size_t k{0}; k < totals.size(); k++) {
+            result.value.push_back(samples ? static_cast<double>(totals[k]) / samples : 0.0);
+            result.halfWidth.push_back(samples ? halfWidth(k, samples) : 0.0);
+        }
+        return result;
+    }
+
+    // Samples particles [first, first + count) into packed storage, first a multiple of PackedParticles::wordBits.
+    template<typename Source>
+    void samplePacked(PackedParticles &particles, size_t first, size_t count, const Source &s) {
+        forEachTile(first, count, s, [&](size_t, size_t begin, NodeMajorView<State> tileStates) {
+            particles.store(begin, {tileStates.data, tileStates.ld, tileStates.count});
+        });
+    }
+
+    void sample(NodeMajorView<State> states, uint64_t seed) {
+        forEachChunk(states, seed, [](size_t, size_t, NodeMajorView<State>) {});
+    }
+
+    void sample(NodeMajorView<State> states, const SobolSampler &s) {
+        forEachChunk(states, s, [](size_t, size_t, NodeMajorView<State>) {});
+    }
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <bit>
+#include <vector>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+
+#include "compiledNetwork.h"
+
+namespace S = std;
+
+// Retained particles packed node-major, each state in a power-of-two number of bits. Workers may store disjoint
+// ranges that start at multiples of wordBits concurrently.
+struct PackedParticles {
+    static constexpr size_t wordBits{64};
+
+    size_t capacity;
+    // Bits per state of every node, and the first word of its column.
+    S::vector<uint32_t> width;
+    S::vector<size_t> columnOffsets;
+    AlignedVector<uint64_t> words;
+
+    [[nodiscard]] static uint32_t widthOf(size_t states) {
+        return S::bit_ceil(S::max<uint32_t>(S::bit_width(S::max<size_t>(states, 2) - 1), 1));
+    }
+
+    PackedParticles(const CompiledNetwork &network, size_t capacity) : capacity(capacity) {
+        columnOffsets.push_back(0);
+        for (size_t n{0}; n < network.size(); n++) {
+            width.push_back(widthOf(network.stateIds[n].size()));
+            columnOffsets.push_back(columnOffsets.back() + (capacity * width.back() + wordBits - 1) / wordBits);
+        }
+        words.resize(columnOffsets.back());
+    }
+
+    [[nodiscard]] size_t nodes() const { return width.size(); }
+
+    [[nodiscard]] size_t bytes() const { return words.size() * sizeof(uint64_t); }
+
+    [[nodiscard]] State at(size_t particle, size_t node) const {
+        const auto b{width[node]};
+        const auto bit{particle * b};
+        return words[columnOffsets[node] + bit / wordBits] >> bit % wordBits & ((uint64_t{1} << b) - 1);
+    }
+
+    // States of every node of one particle, in compiled order.
+    void particle(size_t index, State *out) const {
+        for (size_t n{0}; n < nodes(); n++) out[n] = at(index, n);
+    }
+
+    template<uint32_t B>
+    static void packWords(const State *in, size_t count, uint64_t *out) {
+        constexpr size_t perWord{wordBits / B};
+        size_t w{0};
+        for (; (w + 1) * perWord <= count; w++) {
+            uint64_t word{0};
+            for (size_t j{0}; j < perWord; j++) word |= uint64_t{in[w * perWord + j]} << (j * B);
+            out[w] = word;
+        }
+        if (w * perWord == count) return;
+        uint64_t word{0};
+        for (auto j{w * perWord}; j < count; j++) word |= uint64_t{in[j]} << ((j - w * perWord) * B);
+        out[w] = word;
+    }
+
+    template<uint32_t B>
+    static void unpackWords(const uint64_t *in, size_t count, State *out) {
+        constexpr size_t perWord{wordBits / B};
+        constexpr uint64_t mask{(uint64_t{1} << B) - 1};
+        size_t w{0};
+        for (; (w + 1) * perWord <= count; w++)
+            for (size_t j{0}; j < perWord; j++) out[w * perWord + j] = in[w] >> (j * B) & mask;
+        for (auto j{w * perWord}; j < count; j++) out[j] = in[w] >> ((j - w * perWord) * B) & mask;
+    }
+
+    template<typename Function>
+    static void dispatch(uint32_t b, Function &&fn) {
+        switch (b) {
+            case 1: fn(S::integral_constant<uint32_t, 1>{}); break;
+            case 2: fn(S::integral_constant<uint32_t, 2>{}); break;
+            case 4: fn(S::integral_constant<uint32_t, 4>{}); break;
+            case 8: fn(S::integral_constant<uint32_t, 8>{}); break;
+            case 16: fn(S::integral_constant<uint32_t, 16>{}); break;
+            default: fn(S::integral_constant<uint32_t, 32>{}); break;
+        }
+    }
+
+    // Packs a tile of particles into [first, first + states.count); first must be a multiple of wordBits.
+    void store(size_t first, NodeMajorView<const State> states) {
+        assert(first % wordBits == 0 && first + states.count <= capacity);
+        for (size_t n{0}; n < nodes(); n++)
+            dispatch(width[n], [&](auto b) {
+                const auto column{words.data() + columnOffsets[n] + first * b / wordBits};
+                packWords<decltype(b)::value>(states.row(n), states.count, column);
+            });
+    }
+
+    // States of node over particles [first, first + count) into out.
+    void column(size_t node, size_t first, size_t count, State *out) const {
+        const auto b{width[node]};
+        const auto perWord{wordBits / b};
+        size_t i{0};
+        for (; i < count && (first + i) % perWord; i++) out[i] = at(first + i, node);
+        if (i == count) return;
+        const auto packed{words.data() + columnOffsets[node] + (first + i) / perWord};
+        dispatch(b, [&](auto constant) { unpackWords<decltype(constant)::value>(packed, count - i, out + i); });
+    }
+
+    // Adds the states of node over particles [first, first + count) to histogram, one slot per 2^width values.
+    void addCounts(size_t node, size_t first, size_t count, uint64_t *histogram) const {
+        const auto b{width[node]};
+        const auto perWord{wordBits / b};
+        alignas(64) State block[512];
+        const auto unpacked = [&](size_t from, size_t to) {
+            for (auto p{from}; p < to; p += 512) {
+                const auto n{S::min<size_t>(512, to - p)};
+                column(node, p, n, block);
+                for (size_t i{0}; i < n; i++) histogram[block[i]]++;
+            }
+        };
+        if (b > 2) return unpacked(first, first + count);
+
+        const auto begin{S::min(first + count, (first + perWord - 1) / perWord * perWord)};
+        const auto end{S::max(begin, (first + count) / perWord * perWord)};
+        unpacked(first, begin);
+        const auto packed{words.data() + columnOffsets[node]};
+        uint64_t ones[4]{};
+        for (auto w{begin / perWord}; w < end / perWord; w++) {
+            const auto word{packed[w]};
+            if (b == 1) {
+                ones[1] += S::popcount(word);
+                continue;
+            }
+            constexpr uint64_t low{0x5555555555555555ull};
+            const auto lo{word & low}, hi{word >> 1 & low};
+            ones[1] += S::popcount(lo & ~hi);
+            ones[2] += S::popcount(hi & ~lo);
+            ones[3] += S::popcount(lo & hi);
+        }
+        histogram[0] += end - begin - ones[1] - ones[2] - ones[3];
+        for (size_t x{1}; x < (size_t{1} << b); x++) histogram[x] += ones[x];
+        unpacked(end, first + count);
+    }
+};
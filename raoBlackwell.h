@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <type_traits>
+
+#include "threadPool.h"
+#include "compiledNetwork.h"
+#include "networkSampler.h"
+#include "likelihoodWeighting.h"
+#include "gibbs.h"
+
+namespace S = std;
+
+// Rao-Blackwellized likelihood weighting: targets add their CPT row given the sampled parents, or their
+// conditional given the Markov blanket when evidence lies below them, instead of a count.
+struct RaoBlackwellSampler {
+    enum class Estimate : uint8_t { evidence, rows, blanket };
+
+    NetworkSampler &sampler;
+    MarkovBlankets blankets;
+    // Per-worker conditionals, maxArity rows of batchTile particles.
+    S::vector<Padded<AlignedVector<float>>> conditionals;
+
+    explicit RaoBlackwellSampler(NetworkSampler &sampler) :
+            sampler(sampler), blankets(sampler.network), conditionals(sampler.pool.size()) {}
+
+    [[nodiscard]] float *conditionalTile(size_t worker) {
+        auto &tile{conditionals[worker].value};
+        if (tile.empty()) tile.resize(blankets.maxArity * CompiledNetwork::batchTile);
+        return tile.data();
+    }
+
+    // Adds the weighted Markov blanket conditional of node n, over at most batchTile particles, to sums.
+    void addConditional(const CompiledNetwork &network, size_t n, NodeMajorView<const State> states,
+                        const double *weights, float *conditional, uint32_t *offsets, double *sums) const {
+        constexpr auto ld{CompiledNetwork::batchTile};
+        const auto arity{network.arity[n]};
+        blankets.logConditionals(network, n, states, conditional, offsets);
+
+        alignas(64) float scale[ld];
+        for (size_t i{0}; i < states.count; i++) scale[i] = conditional[i];
+        for (uint32_t x{1}; x < arity; x++)
+            for (size_t i{0}; i < states.count; i++) scale[i] = S::max(scale[i], conditional[x * ld + i]);
+        alignas(64) float total[ld]{};
+        for (uint32_t x{0}; x < arity; x++)
+            for (size_t i{0}; i < states.count; i++)
+                total[i] += conditional[x * ld + i] = S::exp(conditional[x * ld + i] - scale[i]);
+        alignas(64) double weight[ld];
+        for (size_t i{0}; i < states.count; i++) weight[i] = weights[i] / total[i];
+
+        for (uint32_t x{0}; x < arity; x++) {
+            auto sum{0.0};
+            for (size_t i{0}; i < states.count; i++) sum += conditional[x * ld + i] * weight[i];
+            sums[x] += sum;
+        }
+    }
+
+    // Posterior marginals of the target compiled nodes given evidence from the particles of s, as
+    // likelihoodWeighting; evidence may be empty for prior marginals.
+    template<typename Source> requires (!S::is_integral_v<Source>)
+    PosteriorResult sample(const S::vector<size_t> &targets, const Evidence &evidence, size_t samples,
+                           const Source &s) {
+        const auto &network{sampler.network};
+        auto offsets = S::vector<size_t>{0};
+        for (const auto n : targets) offsets.push_back(offsets.back() + network.arity[n]);
+        const auto states{offsets.back()};
+
+        auto evidenceBelow = S::vector<uint8_t>(network.size());
+        for (auto n{network.size()}; n-- > 0;)
+            for (auto c{blankets.childOffsets[n]}; c < blankets.childOffsets[n + 1]; c++) {
+                const auto child{blankets.childIndices[c]};
+                evidenceBelow[n] |= evidence.observed(child) || evidenceBelow[child];
+            }
+
+        // Row sums of the targets estimated by rows follow the state sums, so they are merged along with them.
+        auto estimates = S::vector<Estimate>(targets.size());
+        auto rowOffsets = S::vector<size_t>(targets.size());
+        auto end{states};
+        for (size_t q{0}; q < targets.size(); q++) {
+            const auto n{targets[q]};
+            estimates[q] = evidence.observed(n) ? Estimate::evidence : evidenceBelow[n] ? Estimate::blanket
+                                                                                         : Estimate::rows;
+            rowOffsets[q] = end;
+            if (estimates[q] == Estimate::rows) end += network.rowCount(n);
+        }
+
+        auto counts = S::vector<Padded<WeightedCounts>>(sampler.pool.size());
+        sampler.forEachWeightedTile(0, samples, s, evidence, [&](size_t worker, size_t, NodeMajorView<State> tile,
+                                                                 const float *logWeights) {
+            auto &c{counts[worker].value};
+            if (c.sums.empty()) c.sums.resize(end);
+            if (!c.weigh(logWeights, tile.count)) return;
+            alignas(64) uint32_t parentRows[CompiledNetwork::batchTile];
+            const auto &local{sampler.localNetwork(worker)};
+            const auto conditional{conditionalTile(worker)};
+
+            for (size_t first{0}; first < tile.count; first += CompiledNetwork::batchTile) {
+                const auto part{tile.columns(first, S::min(first + CompiledNetwork::batchTile, tile.count))};
+                const NodeMajorView<const State> particles{part.data, part.ld, part.count};
+                const auto weights{c.tileWeights.data() + first};
+                for (size_t q{0}; q < targets.size(); q++) {
+                    const auto n{targets[q]};
+                    if (estimates[q] == Estimate::blanket) {
+                        addConditional(local, n, particles, weights, conditional, parentRows,
+                                       c.sums.data() + offsets[q]);
+                    } else if (estimates[q] == Estimate::rows) {
+                        local.rowOffsets(n, particles, parentRows);
+                        const auto table{local.tableOffsets[n]};
+                        const auto width{local.rowWidth[n]};
+                        const auto rows{c.sums.data() + rowOffsets[q]};
+                        for (size_t i{0}; i < particles.count; i++) rows[(parentRows[i] - table) / width] += weights[i];
+                    }
+                }
+            }
+        });
+
+        WeightedCounts total;
+        for (const auto &c : counts) total.merge(c.value);
+        if (!total.possible) return total.result(states);
+        total.sums.resize(end);
+        for (size_t q{0}; q < targets.size(); q++) {
+            const auto n{targets[q]};
+            const auto sums{total.sums.data() + offsets[q]};
+            if (estimates[q] == Estimate::evidence) sums[evidence.states[n]] = total.weight;
+            if (estimates[q] != Estimate::rows) continue;
+            const auto width{network.rowWidth[n]};
+            for (size_t r{0}; r < network.rowCount(n); r++) {
+                const auto weight{total.sums[rowOffsets[q] + r]};
+                if (weight == 0) continue;
+                const auto log{network.logArena.data() + network.logOffsets[n] + r * width};
+                for (uint32_t x{0}; x < network.arity[n]; x++) sums[x] += weight * S::exp(static_cast<double>(log[x]));
+            }
+        }
+        return total.result(states);
+    }
+
+    PosteriorResult sample(const S::vector<size_t> &targets, const Evidence &evidence, size_t samples,
+                           uint64_t seed) {
+        return sample(targets, evidence, samples, CounterSampler{seed});
+    }
+};
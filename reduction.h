@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+
+namespace S = std;
+
+// Returns x unchanged but hidden from the optimizer, so -ffast-math cannot fold compensation terms to zero.
+inline double opaque(double x) {
+#if defined(__x86_64__) || defined(__i386__)
+    asm("" : "+x"(x));
+#elif defined(__aarch64__)
+    asm("" : "+w"(x));
+#else
+    volatile double v{x};
+    x = v;
+#endif
+    return x;
+}
+
+// Neumaier's variant of Kahan summation.
+struct CompensatedSum {
+    double sum{0};
+    double compensation{0};
+
+    inline void add(double x) {
+        const auto t{opaque(sum + x)};
+        compensation += S::abs(sum) >= S::abs(x) ? (sum - t) + x : (x - t) + sum;
+        sum = t;
+    }
+
+    inline void add(const CompensatedSum &other) {
+        add(other.sum);
+        compensation += other.compensation;
+    }
+
+    [[nodiscard]] double value() const { return sum + compensation; }
+};
+
+// Runs below this size are summed in a vectorized loop; above it halves are summed recursively in double.
+constexpr size_t pairwiseBase{128};
+
+inline double pairwiseSum(const float *values, size_t count) {
+    if (count > pairwiseBase) {
+        // Split at a multiple of pairwiseBase so the runs at the leaves stay whole.
+        const auto half{(count / 2 + pairwiseBase / 2) / pairwiseBase * pairwiseBase};
+        return pairwiseSum(values, half) + pairwiseSum(values + half, count - half);
+    }
+    constexpr size_t lanes{16};
+    float lane[lanes]{};
+    size_t i{0};
+    for (; i + lanes <= count; i += lanes)
+        for (size_t l{0}; l < lanes; l++) lane[l] += values[i + l];
+    for (; i < count; i++) lane[0] += values[i];
+    float res{0.0f};
+    for (const auto v : lane) res += v;
+    return res;
+}
+
+// Element-wise compensated accumulation of C into a container of CompensatedSum.
+template<typename Sums, typename C>
+void addCompensated(Sums &sums, const C &values) {
+    for (size_t k{0}; k < sums.size(); k++) sums[k].add(values[k]);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "threadPool.h"
+#include "compiledNetwork.h"
+#include "networkSampler.h"
+
+namespace S = std;
+
+struct RejectionResult {
+    // Posterior probability of every state of the target nodes, the states of each node in turn.
+    S::vector<double> value;
+    size_t proposed{0};
+    size_t accepted{0};
+    // Node states drawn over all proposals; a full forward pass costs network.size() per proposal.
+    size_t nodeSamples{0};
+
+    // Also the estimate of P(evidence).
+    [[nodiscard]] double acceptanceRate() const {
+        return proposed ? static_cast<double>(accepted) / proposed : 0.0;
+    }
+
+    // Node states drawn per accepted particle.
+    [[nodiscard]] double costPerAccepted() const {
+        return accepted ? static_cast<double>(nodeSamples) / accepted : 0.0;
+    }
+};
+
+struct RejectionCounts {
+    S::vector<uint64_t> counts;
+    size_t accepted{0};
+    size_t nodeSamples{0};
+};
+
+// Posterior marginals of the target compiled nodes given evidence from the proposals, out of samples, that match
+// it; a proposal stops at the first evidence node it contradicts.
+inline RejectionResult rejectionSampling(NetworkSampler &sampler, const S::vector<size_t> &targets,
+                                         const Evidence &evidence, size_t samples, uint64_t seed) {
+    const auto s{CounterSampler{seed}};
+    auto offsets = S::vector<size_t>{0};
+    for (const auto n : targets) offsets.push_back(offsets.back() + sampler.network.arity[n]);
+    auto workers = S::vector<Padded<RejectionCounts>>(sampler.pool.size());
+
+    sampler.forEachAcceptedTile(0, samples, s, evidence, [&](size_t worker, size_t, NodeMajorView<State> states,
+                                                             size_t nodeSamples) {
+        auto &w{workers[worker].value};
+        if (w.counts.empty()) w.counts.resize(offsets.back());
+        w.accepted += states.count;
+        w.nodeSamples += nodeSamples;
+        for (size_t q{0}; q < targets.size(); q++) {
+            const auto row{states.row(targets[q])};
+            const auto counters{w.counts.data() + offsets[q]};
+            for (size_t i{0}; i < states.count; i++) counters[row[i]]++;
+        }
+    });
+
+    RejectionResult result{S::vector<double>(offsets.back()), samples};
+    auto counts = S::vector<uint64_t>(offsets.back());
+    for (const auto &w : workers) {
+        result.accepted += w.value.accepted;
+        result.nodeSamples += w.value.nodeSamples;
+        for (size_t k{0}; k < w.value.counts.size(); k++) counts[k] += w.value.counts[k];
+    }
+    for (size_t k{0}; k < counts.size(); k++)
+        result.value[k] = result.accepted ? static_cast<double>(counts[k]) / result.accepted : 0.0;
+    return result;
+}
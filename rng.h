@@ -0,0 +1,146 @@
+#pragma once
+
+#include <bit>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+#include "pcg-cpp/include/pcg_random.hpp"
+
+namespace S = std;
+
+// Uniform float in [0, 1) from the top 23 bits of a raw draw, used as the mantissa of a float in [1, 2).
+inline float uniformFloat(uint32_t bits) { return S::bit_cast<float>(0x3F800000u | bits >> 9) - 1.0f; }
+
+// Scalar pcg32, the original Sampler generator.
+struct Pcg32Uniforms {
+    pcg32 rng;
+
+    template<typename SeedSeq>
+    explicit Pcg32Uniforms(SeedSeq &&seq) : rng(seq) {}
+
+    inline float next() { return uniformFloat(rng()); }
+
+    inline void fill(float *out, size_t count) { for (size_t i{0}; i < count; i++) out[i] = next(); }
+
+    inline void fill(uint32_t *out, size_t count) { for (size_t i{0}; i < count; i++) out[i] = rng(); }
+};
+
+// LANES independent pcg32 streams advanced in lock step, so the per-lane loops vectorize. next() and both fill()
+// overloads consume the same stream, raw draws and floats alike.
+template<size_t LANES>
+struct PcgLanes {
+    static constexpr uint64_t multiplier{6364136223846793005ULL};
+
+    alignas(64) S::array<uint64_t, LANES> state;
+    alignas(64) S::array<uint64_t, LANES> increment;
+    alignas(64) S::array<uint32_t, LANES> block;
+    size_t position{LANES};
+
+    template<typename SeedSeq>
+    explicit PcgLanes(SeedSeq &&seq) {
+        S::array<uint32_t, 4 * LANES> seeds;
+        seq.generate(seeds.begin(), seeds.end());
+        for (size_t l{0}; l < LANES; l++) {
+            const auto seed{uint64_t{seeds[4 * l]} << 32 | seeds[4 * l + 1]};
+            const auto stream{uint64_t{seeds[4 * l + 2]} << 32 | seeds[4 * l + 3]};
+            // Distinct odd increments give statistically independent streams.
+            increment[l] = (stream + l) << 1 | 1u;
+            state[l] = (seed + increment[l]) * multiplier + increment[l];
+        }
+    }
+
+    // Only AVX-512DQ multiplies 64-bit lanes natively; on AVX2 the compiler builds the LCG multiply from 32-bit
+    // vpmuludq products, which measured faster than splitting it by hand.
+    inline void step(uint32_t *out) {
+        for (size_t l{0}; l < LANES; l++) {
+            const auto old{state[l]};
+            state[l] = old * multiplier + increment[l];
+            const auto xorShifted{static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u)};
+            const auto rotation{static_cast<uint32_t>(old >> 59u)};
+            out[l] = (xorShifted >> rotation) | (xorShifted << ((32u - rotation) & 31u));
+        }
+    }
+
+    inline void step(float *out) {
+        alignas(64) uint32_t bits[LANES];
+        step(bits);
+        for (size_t l{0}; l < LANES; l++) out[l] = uniformFloat(bits[l]);
+    }
+
+    inline uint32_t nextBits() {
+        if (position == LANES) {
+            step(block.data());
+            position = 0;
+        }
+        return block[position++];
+    }
+
+    inline float next() { return uniformFloat(nextBits()); }
+
+    // Drains the buffered block, then whole blocks, and buffers the rest of the last one.
+    inline void fill(float *out, size_t count) {
+        size_t i{0};
+        for (; position < LANES && i < count; i++) out[i] = uniformFloat(block[position++]);
+        for (; i + LANES <= count; i += LANES) step(out + i);
+        for (; i < count; i++) out[i] = next();
+    }
+
+    inline void fill(uint32_t *out, size_t count) {
+        size_t i{0};
+        for (; position < LANES && i < count; i++) out[i] = block[position++];
+        for (; i + LANES <= count; i += LANES) step(out + i);
+        for (; i < count; i++) out[i] = nextBits();
+    }
+};
+
+// Philox4x32-10: a keyed bijection on 128-bit counters, so any block of the stream is computed directly.
+struct Philox {
+    typedef S::array<uint32_t, 4> Block;
+    typedef S::array<uint32_t, 2> Key;
+
+    static constexpr uint32_t multiplier0{0xD2511F53u}, multiplier1{0xCD9E8D57u};
+    static constexpr uint32_t weyl0{0x9E3779B9u}, weyl1{0xBB67AE85u};
+
+    static inline Block block(Block counter, Key key) {
+        for (size_t round{0}; round < 10; round++) {
+            const auto product0{uint64_t{multiplier0} * counter[0]};
+            const auto product1{uint64_t{multiplier1} * counter[2]};
+            counter = {static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key[0], static_cast<uint32_t>(product1),
+                       static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key[1], static_cast<uint32_t>(product0)};
+            key = {key[0] + weyl0, key[1] + weyl1};
+        }
+        return counter;
+    }
+};
+
+// Uniforms addressed by (seed, sample index, dimension): dimension d of sample i is word d % 4 of the Philox
+// block at counter (i, d / 4) under the key seed.
+struct CounterSampler {
+    uint64_t seed;
+
+    [[nodiscard]] Philox::Block bits(uint64_t sample, uint64_t dimensionBlock) const {
+        return Philox::block({static_cast<uint32_t>(sample), static_cast<uint32_t>(sample >> 32),
+                              static_cast<uint32_t>(dimensionBlock), static_cast<uint32_t>(dimensionBlock >> 32)},
+                             {static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)});
+    }
+
+    [[nodiscard]] float at(uint64_t sample, uint64_t dimension) const {
+        return uniformFloat(bits(sample, dimension / 4)[dimension % 4]);
+    }
+
+    void fill(uint64_t sample, float *out, size_t dimensions) const {
+        for (size_t d{0}; d < dimensions; d += 4) {
+            const auto block{bits(sample, d / 4)};
+            for (size_t w{0}; w < 4 && d + w < dimensions; w++) out[d + w] = uniformFloat(block[w]);
+        }
+    }
+
+    void fill(uint64_t sample, uint32_t *out, size_t dimensions) const {
+        for (size_t d{0}; d < dimensions; d += 4) {
+            const auto block{bits(sample, d / 4)};
+            for (size_t w{0}; w < 4 && d + w < dimensions; w++) out[d + w] = block[w];
+        }
+    }
+};
@@ -0,0 +1,971 @@
+#include <cmath>
+#include <atomic>
+#include <barrier>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <numeric>
+#include <iostream>
+#include <algorithm>
+
+#include "MCIntegrator.h"
+#include "networkLoader.h"
+#include "compiledNetwork.h"
+#include "networkSampler.h"
+#include "likelihoodWeighting.h"
+#include "rejectionSampling.h"
+#include "gibbs.h"
+#include "importanceSampling.h"
+#include "raoBlackwell.h"
+#include "jointQueries.h"
+#include "packedParticles.h"
+
+namespace S = std;
+
+// Checks the samplers against exact enumeration of a small network. Usage: samplerTests <network.xdsl>
+
+static size_t failures{0};
+
+void check(bool passed, const S::string &what) {
+    S::cout << (passed ? "ok      " : "FAILED  ") << what << '\n';
+    if (!passed) failures++;
+}
+
+[[nodiscard]] double maxDifference(const S::vector<double> &a, const S::vector<double> &b) {
+    if (a.size() != b.size()) return INFINITY;
+    auto res{0.0};
+    for (size_t k{0}; k < a.size(); k++) res = S::max(res, S::abs(a[k] - b[k]));
+    return res;
+}
+
+void checkClose(const S::string &what, const S::vector<double> &estimate, const S::vector<double> &exact,
+                double tolerance) {
+    const auto error{maxDifference(estimate, exact)};
+    check(error <= tolerance, what + ": max error " + S::to_string(error));
+}
+
+// Distribution of a network given evidence, by enumerating the assignments of every node but the unobserved
+// leaves, which do not change the others' joint and are added back where a query names them.
+struct Enumeration {
+    const BN_Network &raw;
+    const CompiledNetwork &network;
+    S::vector<size_t> compiled;
+    S::vector<uint8_t> leaf;
+    // Stride of each enumerated node in an assignment, compiled node 0 varying fastest.
+    S::vector<size_t> strides;
+    // P(assignment, evidence) of every assignment.
+    S::vector<double> joint;
+    double evidence{0};
+
+    Enumeration(const BN_Network &raw, const CompiledNetwork &network, const Evidence &observed) :
+            raw(raw), network(network), compiled(network.size()), leaf(network.size(), 1), strides(network.size()) {
+        for (size_t n{0}; n < network.size(); n++) {
+            compiled[network.sourceIndex[n]] = n;
+            for (auto p{network.parentOffsets[n]}; p < network.parentOffsets[n + 1]; p++)
+                leaf[network.parentIndices[p]] = 0;
+        }
+        size_t assignments{1};
+        for (size_t n{0}; n < network.size(); n++) {
+            leaf[n] &= !observed.observed(n);
+            if (leaf[n]) continue;
+            strides[n] = assignments;
+            assignments *= network.arity[n];
+        }
+        joint.resize(assignments);
+
+        auto states = S::vector<State>(network.size());
+        for (size_t c{0}; c < joint.size(); c++) {
+            auto p{1.0};
+            for (size_t n{0}; n < network.size(); n++) {
+                if (leaf[n]) continue;
+                states[n] = c / strides[n] % network.arity[n];
+                if (observed.observed(n) && states[n] != observed.states[n]) p = 0;
+                p *= probability(n, states.data());
+            }
+            joint[c] = p;
+            evidence += p;
+        }
+    }
+
+    // P(states[n] | states of its parents), from the raw CPT.
+    [[nodiscard]] double probability(size_t n, const State *states) const {
+        const auto node{raw.nodes[network.sourceIndex[n]]};
+        size_t row{0};
+        for (size_t q{0}; q < node->parents.size(); q++)
+            row += states[compiled[node->parents[q]->index]] * node->cumulativeCpt.pRadix[q];
+        auto total{0.0};
+        for (size_t x{0}; x < network.arity[n]; x++) total += node->cpt[row + x];
+        return node->cpt[row + states[n]] / total;
+    }
+
+    // Calls fn(states, p) for every assignment of the enumerated nodes and of the leaves among nodes, with p its
+    // probability given the evidence.
+    template<typename Function>
+    void forEachAssignment(const S::vector<size_t> &nodes, Function &&fn) const {
+        auto leaves = S::vector<size_t>();
+        for (const auto n : nodes)
+            if (leaf[n] && S::find(leaves.begin(), leaves.end(), n) == leaves.end()) leaves.push_back(n);
+        auto states = S::vector<State>(network.size());
+        for (size_t c{0}; c < joint.size(); c++) {
+            if (joint[c] == 0) continue;
+            for (size_t n{0}; n < network.size(); n++) if (!leaf[n]) states[n] = c / strides[n] % network.arity[n];
+            for (const auto n : leaves) states[n] = 0;
+            for (;;) {
+                auto p{joint[c] / evidence};
+                for (const auto n : leaves) p *= probability(n, states.data());
+                fn(states, p);
+                size_t l{0};
+                for (; l < leaves.size() && ++states[leaves[l]] == network.arity[leaves[l]]; l++) states[leaves[l]] = 0;
+                if (l == leaves.size()) break;
+            }
+        }
+    }
+
+    // P(state | evidence) of every state of the targets, the states of each node in turn.
+    [[nodiscard]] S::vector<double> marginals(const S::vector<size_t> &targets) const {
+        auto offsets = S::vector<size_t>{0};
+        for (const auto n : targets) offsets.push_back(offsets.back() + network.arity[n]);
+        auto res = S::vector<double>(offsets.back());
+        for (size_t q{0}; q < targets.size(); q++)
+            forEachAssignment({targets[q]}, [&](const S::vector<State> &states, double p) {
+                res[offsets[q] + states[targets[q]]] += p;
+            });
+        return res;
+    }
+
+    // P(targets | given, evidence) of every cell of result, or 0 where P(given | evidence) is below minGiven, so
+    // that rarely sampled configurations are not compared.
+    [[nodiscard]] S::vector<double> conditional(const JointQuery &query, const JointResult &result,
+                                                double minGiven) const {
+        uint64_t targetCells{1}, cells{1};
+        for (const auto n : query.targets) targetCells *= network.arity[n];
+        for (const auto n : result.nodes) cells *= network.arity[n];
+        auto table = S::vector<double>(cells);
+        auto cell = S::vector<State>(result.nodes.size());
+        forEachAssignment(result.nodes, [&](const S::vector<State> &states, double p) {
+            for (size_t q{0}; q < cell.size(); q++) cell[q] = states[result.nodes[q]];
+            table[result.index(cell)] += p;
+        });
+        for (uint64_t first{0}; first < cells; first += targetCells) {
+            auto given{0.0};
+            for (auto k{first}; k < first + targetCells; k++) given += table[k];
+            for (auto k{first}; k < first + targetCells; k++) table[k] = given >= minGiven ? table[k] / given : 0.0;
+        }
+        return table;
+    }
+};
+
+// Values of result at every cell, as Enumeration::conditional, 0 where exact is.
+[[nodiscard]] S::vector<double> cellValues(const JointResult &result, const S::vector<double> &exact) {
+    auto res = S::vector<double>(exact.size());
+    for (size_t k{0}; k < result.cells.size(); k++)
+        if (exact[result.cells[k]] > 0) res[result.cells[k]] = result.value[k];
+    return res;
+}
+
+// Frequency of every state of every node over particles, the states of each node in turn.
+[[nodiscard]] S::vector<double> frequencies(const CompiledNetwork &network, NodeMajorView<const State> particles) {
+    auto res = S::vector<double>();
+    for (size_t n{0}; n < network.size(); n++) {
+        auto counts = S::vector<size_t>(network.arity[n]);
+        for (size_t i{0}; i < particles.count; i++) counts[particles.row(n)[i]]++;
+        for (const auto c : counts) res.push_back(static_cast<double>(c) / particles.count);
+    }
+    return res;
+}
+
+void checkCompiledNetwork(const BN_Network &raw, const CompiledNetwork &network, const Enumeration &prior) {
+    auto ordered{true}, logRows{true}, cumulativeRows{true};
+    for (size_t n{0}; n < network.size(); n++) {
+        for (auto p{network.parentOffsets[n]}; p < network.parentOffsets[n + 1]; p++)
+            ordered &= network.parentIndices[p] < n;
+        const auto node{raw.nodes[network.sourceIndex[n]]};
+        const auto lineSize{network.arity[n]}, width{network.rowWidth[n]};
+        for (size_t r{0}; r < network.rowCount(n); r++) {
+            const auto line{node->cpt.data() + r * lineSize};
+            const auto total{S::accumulate(line, line + lineSize, 0.0)};
+            auto cumulative{0.0};
+            for (size_t x{0}; x < width; x++) {
+                const auto p{x < lineSize ? line[x] / total : 0.0};
+                const auto log{network.logArena[network.logOffsets[n] + r * width + x]};
+                logRows &= p > 0 ? S::abs(log - S::log(p)) < 1e-5 : log == CompiledNetwork::logZero;
+                cumulative += p;
+                if (network.aliasRows[n]) continue;
+                const auto threshold{network.arena[network.tableOffsets[n] + r * width + x]};
+                cumulativeRows &= x + 1 < lineSize ? S::abs(threshold - cumulative) < 1e-5
+                                                   : threshold == CompiledNetwork::rowCap;
+            }
+        }
+    }
+    check(ordered, "compiled network, parents before children");
+    check(logRows, "compiled network, log rows");
+    check(cumulativeRows, "compiled network, cumulative rows");
+
+    constexpr size_t particles{size_t{1} << 17};
+    auto states = S::vector<State>(network.size() * particles);
+    auto inputSample = S::vector<float>(network.size());
+    auto nodeStates = S::vector<State>(network.size());
+    S::mt19937 rng{1};
+    for (size_t i{0}; i < particles; i++) {
+        for (auto &u : inputSample) u = uniformFloat(rng());
+        network.sample(inputSample, nodeStates);
+        for (size_t n{0}; n < network.size(); n++) states[n * particles + i] = nodeStates[n];
+    }
+    auto nodes = S::vector<size_t>(network.size());
+    S::iota(nodes.begin(), nodes.end(), size_t{0});
+    checkClose("compiled network, prior", frequencies(network, {states.data(), particles, particles}),
+               prior.marginals(nodes), 0.01);
+}
+
+// State drawn by u from node n's row at offset, by binary search or the alias table, to compare the kernels with.
+[[nodiscard]] State referenceState(const CompiledNetwork &network, size_t n, size_t offset, float u) {
+    return network.aliasRows[n]
+           ? CumulativeCpt::getAliasState(network.aliasArena.data() + offset, network.arity[n], u)
+           : CumulativeCpt::getCumulativeState(network.arena.data() + offset, network.arity[n], u);
+}
+
+void checkBatchSampling(const CompiledNetwork &network, const Enumeration &prior) {
+    // Not a whole number of tiles.
+    constexpr size_t particles{(size_t{1} << 17) + 77};
+    auto uniforms = AlignedVector<float>(network.size() * particles);
+    S::mt19937 rng{2};
+    for (auto &u : uniforms) u = uniformFloat(rng());
+    auto states = AlignedVector<State>(network.size() * particles);
+    network.sampleBatch({uniforms.data(), particles, particles}, {states.data(), particles, particles});
+
+    auto matches{true};
+    auto particle = S::vector<State>(network.size());
+    for (size_t i{0}; i < particles; i++)
+        for (size_t n{0}; n < network.size(); n++) {
+            const auto offset{network.rowOffset(n, particle.data())};
+            particle[n] = referenceState(network, n, offset, uniforms[n * particles + i]);
+            matches &= states[n * particles + i] == particle[n];
+        }
+    check(matches, "batch sampling, same states as one particle at a time");
+    auto nodes = S::vector<size_t>(network.size());
+    S::iota(nodes.begin(), nodes.end(), size_t{0});
+    checkClose("batch sampling, prior", frequencies(network, {states.data(), particles, particles}),
+               prior.marginals(nodes), 0.01);
+}
+
+void checkAliasRows(const BN_Network &raw, const CompiledNetwork &network) {
+    // Evenly spaced draws, so the frequency of a state is its probability up to the grid spacing.
+    constexpr size_t perSlot{size_t{1} << 16};
+    size_t rows{0};
+    auto uneven{false}, floatDraws{true}, rawDraws{true};
+    for (size_t n{0}; n < network.size(); n++) {
+        if (!network.aliasRows[n]) continue;
+        const auto lineSize{network.arity[n]};
+        const auto node{raw.nodes[network.sourceIndex[n]]};
+        for (size_t r{0}; r < network.rowCount(n); r++, rows++) {
+            const auto slots{network.aliasArena.data() + network.tableOffsets[n] + r * lineSize};
+            for (size_t x{0}; x < lineSize; x++) uneven |= slots[x].prob < 1 && slots[x].alias != x;
+            const auto draws{perSlot * lineSize};
+            auto floats = S::vector<size_t>(lineSize), raws = S::vector<size_t>(lineSize);
+            for (size_t k{0}; k < draws; k++) {
+                floats[CumulativeCpt::getAliasState(slots, lineSize, static_cast<float>((k + 0.5) / draws))]++;
+                const auto draw{static_cast<uint32_t>((k * 0x1p32 + 0x1p31) / draws)};
+                raws[CumulativeCpt::getAliasState(slots, lineSize, draw)]++;
+            }
+            const auto line{node->cpt.data() + r * lineSize};
+            const auto total{S::accumulate(line, line + lineSize, 0.0)};
+            for (size_t x{0}; x < lineSize; x++) {
+                floatDraws &= S::abs(static_cast<double>(floats[x]) / draws - line[x] / total) < 1e-4;
+                rawDraws &= S::abs(static_cast<double>(raws[x]) / draws - line[x] / total) < 1e-4;
+            }
+        }
+    }
+    check(rows > 0 && uneven, "alias rows, fixture has uneven alias tables");
+    check(floatDraws, "alias rows, float draws follow the CPT");
+    check(rawDraws, "alias rows, raw draws follow the CPT");
+}
+
+void checkSelectionKernels(const CompiledNetwork &network) {
+    constexpr size_t draws{size_t{1} << 16};
+    auto shared16{false}, gathered16{false}, kernels{true};
+    for (size_t n{0}; n < network.size(); n++) {
+        const auto width{network.rowWidth[n]};
+        if (network.aliasRows[n] || width > CompiledNetwork::simdMaxArity) continue;
+        const auto roots{network.parentOffsets[n] == network.parentOffsets[n + 1]};
+        shared16 |= width == CompiledNetwork::simdMaxArity && network.arity[n] > 8 && roots;
+        gathered16 |= width == CompiledNetwork::simdMaxArity && network.arity[n] > 8 && !roots;
+        for (size_t r{0}; r < network.rowCount(n); r++) {
+            const auto offset{network.tableOffsets[n] + r * width};
+            for (size_t k{0}; k < draws; k++) {
+                const auto u{static_cast<float>((k + 0.5) / draws)};
+                kernels &= network.drawState(n, offset, u) == referenceState(network, n, offset, u);
+            }
+        }
+    }
+    check(shared16 && gathered16, "selection kernels, fixture has 9 to 16 states with and without parents");
+    check(kernels, "selection kernels, same states as binary search");
+}
+
+void checkPcgLanes() {
+    constexpr size_t lanes{16}, draws{size_t{1} << 12};
+    S::seed_seq seq{1, 2, 3};
+    PcgLanes<lanes> bulk(seq), mixed(seq);
+    auto raw = S::vector<uint32_t>(draws);
+    bulk.fill(raw.data(), draws);
+
+    // Lane l is the pcg32 stream its seeds select, the lanes taking turns.
+    auto seeds = S::array<uint32_t, 4 * lanes>();
+    seq.generate(seeds.begin(), seeds.end());
+    auto lanesMatch{true};
+    for (size_t l{0}; l < lanes; l++) {
+        const auto seed{uint64_t{seeds[4 * l]} << 32 | seeds[4 * l + 1]};
+        pcg32 rng(seed, (uint64_t{seeds[4 * l + 2]} << 32 | seeds[4 * l + 3]) + l);
+        for (auto k{l}; k < draws; k += lanes) lanesMatch &= raw[k] == rng();
+    }
+    check(lanesMatch, "pcg lanes, every lane is a pcg32 stream");
+
+    auto sameStream{true};
+    size_t k{0};
+    for (size_t round{0}; k + 3 * 64 < draws; round++) {
+        const auto count{round * 7 % 41};
+        auto floats = S::vector<float>(count);
+        auto bits = S::vector<uint32_t>(count);
+        switch (round % 3) {
+            case 0:
+                for (size_t i{0}; i < count; i++) sameStream &= mixed.next() == uniformFloat(raw[k++]);
+                break;
+            case 1:
+                mixed.fill(floats.data(), count);
+                for (size_t i{0}; i < count; i++) sameStream &= floats[i] == uniformFloat(raw[k++]);
+                break;
+            default:
+                mixed.fill(bits.data(), count);
+                for (size_t i{0}; i < count; i++) sameStream &= bits[i] == raw[k++];
+        }
+    }
+    check(sameStream, "pcg lanes, next and both fills consume one stream");
+}
+
+void checkThresholdRows(const BN_Network &raw, const CompiledNetwork &thresholds) {
+    constexpr size_t draws{size_t{1} << 16};
+    auto rows{true}, kernels{true};
+    for (size_t n{0}; n < thresholds.size(); n++) {
+        if (thresholds.aliasRows[n]) continue;
+        const auto width{thresholds.rowWidth[n]}, lineSize{thresholds.arity[n]};
+        const auto &cumulative{raw.nodes[thresholds.sourceIndex[n]]->cumulativeCpt};
+        for (size_t r{0}; r < thresholds.rowCount(n); r++) {
+            const auto offset{thresholds.tableOffsets[n] + r * width};
+            const auto line{cumulative.thresholds.data() + r * lineSize};
+            const auto row{thresholds.thresholdArena.data() + offset};
+            rows &= S::equal(line, line + lineSize, row);
+            rows &= S::all_of(row + lineSize, row + width,
+                              [](auto t) { return t == S::numeric_limits<uint32_t>::max(); });
+            for (size_t k{0}; k < draws; k++) {
+                const auto draw{static_cast<uint32_t>((k * 0x1p32 + 0x1p31) / draws)};
+                const auto state{CumulativeCpt::getThresholdState(line, lineSize, draw)};
+                kernels &= thresholds.drawState(n, offset, draw) == state;
+            }
+        }
+    }
+    check(rows, "threshold rows, same thresholds as the CPT, padded with the largest draw");
+    check(kernels, "threshold rows, selection kernels match binary search on raw draws");
+}
+
+void checkRawDraws(const CompiledNetwork &thresholds, const Enumeration &prior) {
+    constexpr size_t particles{(size_t{1} << 17) + 77};
+    constexpr uint64_t seed{7};
+    const auto size{thresholds.size()};
+    auto states = S::vector<State>(size * particles), expected = S::vector<State>(size * particles);
+    ThreadPool pool(2);
+    NetworkSampler sampler(thresholds, pool);
+    sampler.sample({states.data(), particles, particles}, seed);
+
+    const auto s{CounterSampler{seed}};
+    auto draws = S::vector<uint32_t>(size * particles);
+    for (size_t i{0}; i < particles; i++)
+        for (size_t n{0}; n < size; n++)
+            draws[n * particles + i] = s.bits(i, n / NetworkSampler::uniformBlock)[n % NetworkSampler::uniformBlock];
+    thresholds.sampleBatch(NodeMajorView<const uint32_t>{draws.data(), particles, particles},
+                           {expected.data(), particles, particles});
+    check(states == expected, "raw draws, network sampler feeds the Philox bits of its seed to the thresholds");
+
+    auto nodes = S::vector<size_t>(size);
+    S::iota(nodes.begin(), nodes.end(), size_t{0});
+    checkClose("raw draws, prior", frequencies(thresholds, {states.data(), particles, particles}),
+               prior.marginals(nodes), 0.01);
+}
+
+void checkCounterSampler(const CompiledNetwork &network) {
+    // Philox4x32-10 known-answer vectors of Random123.
+    check(Philox::block({0, 0, 0, 0}, {0, 0}) == Philox::Block{0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8} &&
+          Philox::block({~0u, ~0u, ~0u, ~0u}, {~0u, ~0u}) == Philox::Block{0x408f276d, 0x41c83b0e, 0xa20bc7c6,
+                                                                               0x6d5451fd} &&
+          Philox::block({0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344}, {0xa4093822, 0x299f31d0}) ==
+          Philox::Block{0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}, "counter sampler, Philox known answers");
+
+    const auto s{CounterSampler{0x1234'5678'9abc'def0}};
+    constexpr size_t dimensions{11};
+    auto consistent{true};
+    float floats[dimensions];
+    uint32_t bits[dimensions];
+    for (uint64_t i : {uint64_t{0}, uint64_t{1}, uint64_t{1} << 40, ~uint64_t{0}}) {
+        s.fill(i, floats, dimensions);
+        s.fill(i, bits, dimensions);
+        for (size_t d{0}; d < dimensions; d++) {
+            consistent &= bits[d] == s.bits(i, d / 4)[d % 4];
+            consistent &= floats[d] == s.at(i, d) && floats[d] == uniformFloat(bits[d]);
+        }
+    }
+    check(consistent, "counter sampler, at, fill and bits address the same draws");
+
+    const auto integrand = [](const auto &in, auto &out) {
+        out[0] = S::exp(-in[0] * in[1]);
+        out[1] = in[2] < 0.25f ? 1.0f : 0.0f;
+    };
+    constexpr size_t samples{(size_t{1} << 18) + 1000};
+    ThreadPool one(1), two(2), four(4);
+    const auto serial{MCIntegrator<3, 2>(samples, 3, 2, integrand, 5)};
+    const auto identical{ParallelMCIntegrator<3, 2>(samples, 3, 2, integrand, 5, one) == serial &&
+                         ParallelMCIntegrator<3, 2>(samples, 3, 2, integrand, 5, two) == serial &&
+                         ParallelMCIntegrator<3, 2>(samples, 3, 2, integrand, 5, four) == serial};
+    check(identical, "counter sampler, seeded integration bit-identical for 1, 2 and 4 workers");
+
+    constexpr size_t particles{3 * NetworkSampler::chunk + 5};
+    auto states1 = S::vector<State>(network.size() * particles), states4 = states1;
+    NetworkSampler(network, one).sample({states1.data(), particles, particles}, 9);
+    NetworkSampler(network, four).sample({states4.data(), particles, particles}, 9);
+    check(states1 == states4, "counter sampler, network particles identical for 1 and 4 workers");
+}
+
+void checkThreadPool() {
+    constexpr size_t chunks{10007};
+    ThreadPool pool(4);
+    auto visits = S::vector<S::atomic<uint32_t>>(2 * chunks);
+    S::atomic<bool> workersValid{true};
+    const auto job = [&](size_t offset) {
+        pool.parallelFor(chunks, [&](size_t worker, size_t c) {
+            if (worker >= pool.size()) workersValid = false;
+            visits[offset + c]++;
+        });
+    };
+    job(0);
+    // Two threads sharing the pool; their jobs run one after the other.
+    auto other = S::thread([&]() { job(chunks); });
+    job(0);
+    other.join();
+    auto covered{true};
+    for (size_t c{0}; c < chunks; c++) covered &= visits[c] == 2 && visits[chunks + c] == 1;
+    check(covered && workersValid, "thread pool, every chunk runs once per job, also with concurrent callers");
+}
+
+void checkPlacement() {
+    const auto detected{Topology::detect()};
+    const auto allowed{Topology::allowedCpus()};
+    auto inMask{!detected.cpus.empty()};
+    for (const auto &info : detected.cpus)
+        inMask &= allowed.empty() || S::find(allowed.begin(), allowed.end(), info.cpu) != allowed.end();
+    check(inMask, "placement, detected CPUs are within the process's affinity mask");
+
+    // Worker 1 is planned on node 1 but on a CPU that does not exist, so pinning it fails; every CPU it can run
+    // on is unknown or on node 0.
+    Topology topology;
+    topology.cpus = {{allowed.empty() ? 0 : allowed[0], 0, 0, 0}, {1000, 1, 0, 1}};
+    topology.numaNodes = 2;
+    ThreadPool pool(topology, Placement::PhysicalCores);
+    check(pool.size() == 2 && pool.numaNode(1) == 0, "placement, a worker that cannot be pinned reports where it runs");
+}
+
+void checkVegas() {
+    const auto peaked = [](const auto &in, auto &out) {
+        constexpr float width{0.05f}, norm{1 / (width * 2.5066283f)};
+        float product{1.0f};
+        for (const auto x : in) product *= norm * S::exp(-(x - 0.5f) * (x - 0.5f) / (2 * width * width));
+        out[0] = product;
+        out[1] = in[0];
+    };
+    VegasOptions options;
+    options.samplesPerIteration = (size_t{1} << 15) + 100;
+    ThreadPool one(1), four(4);
+    VegasContext<3, 2> context;
+    const auto a{VegasIntegrator(context, 3, 2, peaked, options, 11, one)};
+    const auto b{VegasIntegrator(context, 3, 2, peaked, options, 11, four)};
+    check(a.value == b.value && a.error == b.error, "vegas, bit-identical for 1 and 4 workers and a reused context");
+    check(S::abs(a.value[0] - 1) < 4 * a.error[0] && S::abs(a.value[1] - 0.5) < 4 * a.error[1],
+          "vegas, peaked and linear integrals within their error bars");
+
+    // Standard error of plain sampling with the same number of samples, from E[f^2] = (2 width sqrt(pi))^-3.
+    const auto samples{static_cast<double>(options.iterations * options.samplesPerIteration)};
+    const auto plainError{S::sqrt((S::pow(1 / (2 * 0.05 * S::sqrt(M_PI)), 3) - 1) / samples)};
+    check(a.error[0] < 0.1 * plainError && a.chi2PerDof < 3, "vegas, adapted grid beats plain sampling on a peak");
+}
+
+void checkSobol() {
+    constexpr size_t dimensions{64}, maxBits{12};
+    const auto directions = SobolDirections(dimensions);
+    const auto sampler = SobolSampler(directions, 3, 1);
+    // Any aligned run of 2^m points puts one point in each of the 2^m strata of every dimension.
+    auto stratified{true};
+    for (size_t d{0}; d < dimensions; d++)
+        for (size_t m{1}; m <= maxBits; m++)
+            for (const uint64_t first : {uint64_t{0}, uint64_t{3} << m}) {
+                auto hits = S::vector<uint32_t>(size_t{1} << m);
+                for (uint64_t i{0}; i < hits.size(); i++) hits[sampler.bits(first + i, d) >> (32 - m)]++;
+                stratified &= S::all_of(hits.begin(), hits.end(), [](auto h) { return h == 1; });
+            }
+    check(stratified, "sobol, the first 2^m points stratify every dimension");
+
+    // The first two dimensions form a (0, m, 2)-net: one point in each square of a 2^k by 2^k grid.
+    auto net{true};
+    for (size_t k{1}; 2 * k <= maxBits; k++) {
+        auto hits = S::vector<uint32_t>(size_t{1} << 2 * k);
+        for (uint64_t i{0}; i < hits.size(); i++)
+            hits[(sampler.bits(i, 0) >> (32 - k)) << k | sampler.bits(i, 1) >> (32 - k)]++;
+        net &= S::all_of(hits.begin(), hits.end(), [](auto h) { return h == 1; });
+    }
+    check(net, "sobol, the first two dimensions are a (0, m, 2)-net");
+
+    constexpr size_t count{1000};
+    constexpr uint64_t first{12345};
+    auto floats = S::vector<float>(count);
+    auto raw = S::vector<uint32_t>(count);
+    auto consistent{true};
+    for (size_t d{0}; d < dimensions; d += 7) {
+        sampler.fillDimension(first, d, floats.data(), count);
+        sampler.fillDimension(first, d, raw.data(), count);
+        for (size_t i{0}; i < count; i++)
+            consistent &= raw[i] == sampler.bits(first + i, d) && floats[i] == sampler.at(first + i, d);
+    }
+    check(consistent, "sobol, stepping through points matches building each one");
+}
+
+void checkStoppingRule(const CompiledNetwork &network, const Enumeration &prior) {
+    // x y on the unit square: integral 1/4, variance 1/9 - 1/16.
+    const auto product = [](const auto &in, auto &out) { out[0] = in[0] * in[1]; };
+    constexpr double exact{0.25}, variance{7.0 / 144};
+    constexpr size_t runs{50};
+    StoppingRule rule{1e-3};
+    const auto needed{rule.z() * rule.z() * variance / (rule.absoluteError * rule.absoluteError)};
+    ThreadPool one(1), four(4);
+    size_t covered{0};
+    auto met{true}, economical{true};
+    for (uint64_t seed{0}; seed < runs; seed++) {
+        const auto r{SequentialMCIntegrator<2, 1>(2, 1, product, rule, seed, four)};
+        met &= r.converged && r.halfWidth[0] <= rule.absoluteError;
+        economical &= r.samples < 2 * needed;
+        covered += S::abs(r.value[0] - exact) <= r.halfWidth[0];
+    }
+    check(met, "stopping rule, reaches the requested half-width");
+    check(economical, "stopping rule, stops within twice the samples the variance calls for");
+    // 95% intervals: fewer than 42 of 50 covering has probability below 1%.
+    check(covered >= 42, "stopping rule, intervals cover the exact integral at the stated confidence");
+
+    const auto a{SequentialMCIntegrator<2, 1>(2, 1, product, rule, 5, one)};
+    const auto b{SequentialMCIntegrator<2, 1>(2, 1, product, rule, 5, four)};
+    check(a.value == b.value && a.halfWidth == b.halfWidth && a.samples == b.samples,
+          "stopping rule, bit-identical for 1 and 4 workers");
+
+    StoppingRule capped{1e-6};
+    capped.maxSamples = 100000;
+    const auto c{SequentialMCIntegrator<2, 1>(2, 1, product, capped, 5, four)};
+    check(!c.converged && c.samples == capped.maxSamples, "stopping rule, stops unconverged at the cap");
+
+    // Past the fixture's numsamples cap.
+    StoppingRule marginalRule{0.005};
+    marginalRule.maxSamples = size_t{1} << 22;
+    auto nodes = S::vector<size_t>(network.size());
+    S::iota(nodes.begin(), nodes.end(), size_t{0});
+    const auto m{NetworkSampler(network, four).sampleMarginals(nodes, marginalRule, 3)};
+    const auto widest{*S::max_element(m.halfWidth.begin(), m.halfWidth.end())};
+    check(m.converged && widest <= marginalRule.absoluteError && maxDifference(m.value, prior.marginals(nodes)) <
+          2 * marginalRule.absoluteError, "stopping rule, network marginals to the requested half-width");
+}
+
+void checkCompensatedSum() {
+    // Pairs +-v of magnitude up to 1e15 cancel exactly, hiding 10000 halves: the exact sum is 5000, with a
+    // condition number near 1e15.
+    S::mt19937_64 rng{42};
+    S::uniform_real_distribution<double> magnitude{1e12, 1e15};
+    auto values = S::vector<double>();
+    for (size_t i{0}; i < 10000; i++) {
+        const auto v{S::round(magnitude(rng))};
+        values.insert(values.end(), {v, -v, 0.5});
+    }
+    S::shuffle(values.begin(), values.end(), rng);
+    CompensatedSum compensated;
+    for (const auto v : values) compensated.add(v);
+    check(compensated.value() == 5000, "compensated sum, exact on an ill-conditioned sum");
+
+    CompensatedSum halves, merged;
+    for (size_t i{0}; i < values.size(); i++) (i % 2 ? halves : merged).add(values[i]);
+    merged.add(halves);
+    check(merged.value() == 5000, "compensated sum, merging partial sums keeps their compensation");
+
+    // A running float sum of these drifts by percents.
+    auto small = S::vector<float>(size_t{1} << 22, 0.1f);
+    const auto exact{static_cast<double>(0.1f) * small.size()};
+    check(S::abs(pairwiseSum(small.data(), small.size()) - exact) < 1e-6 * exact,
+          "compensated sum, pairwise sums of 2^22 floats to 1e-6");
+}
+
+void checkContextPool() {
+    constexpr size_t threads{6}, samples{size_t{1} << 16};
+    const auto integrand = [](const auto &in, auto &out) { out[0] = in[0] * in[0]; };
+    IntegratorContextPool<1, 1> contexts;
+    auto leased = S::vector<const void *>(threads);
+    auto results = S::vector<double>(threads);
+    // Every thread holds its lease until all have one, so no context can be handed out twice legitimately.
+    S::barrier allLeased{static_cast<ptrdiff_t>(threads)};
+    auto workers = S::vector<S::thread>();
+    for (size_t t{0}; t < threads; t++)
+        workers.emplace_back([&, t]() {
+            auto lease{contexts.acquire()};
+            leased[t] = &*lease;
+            allLeased.arrive_and_wait();
+            ThreadPool pool(1);
+            results[t] = ParallelMCIntegrator(*lease, samples, 1, 1, integrand, t, pool)[0];
+        });
+    for (auto &w : workers) w.join();
+    auto sorted{leased};
+    S::sort(sorted.begin(), sorted.end());
+    check(S::adjacent_find(sorted.begin(), sorted.end()) == sorted.end(),
+          "context pool, concurrent leases are distinct");
+
+    auto same{true};
+    for (size_t t{0}; t < threads; t++)
+        same &= results[t] == ParallelMCIntegrator<1, 1>(samples, 1, 1, integrand, t)[0];
+    const auto reused{contexts.acquire()};
+    check(same && S::find(leased.begin(), leased.end(), &*reused) != leased.end(),
+          "context pool, leased runs match fresh ones and released contexts are reused");
+}
+
+void checkLikelihoodWeighting(const CompiledNetwork &network, const CompiledNetwork &thresholds,
+                              const Evidence &evidence, const Enumeration &prior, const Enumeration &posterior) {
+    constexpr size_t samples{size_t{1} << 18};
+    ThreadPool single(1), pool(4);
+    NetworkSampler serial(network, single), sampler(network, pool), thresholdSampler(thresholds, pool);
+    const Evidence none(network);
+    auto nodes = S::vector<size_t>(network.size());
+    S::iota(nodes.begin(), nodes.end(), size_t{0});
+
+    const auto weighted{likelihoodWeighting(sampler, nodes, evidence, samples, 1)};
+    checkClose("likelihood weighting, prior", likelihoodWeighting(sampler, nodes, none, samples, 1).value,
+               prior.marginals(nodes), 0.01);
+    checkClose("likelihood weighting, posterior", weighted.value, posterior.marginals(nodes), 0.01);
+    checkClose("likelihood weighting, log P(evidence)", {weighted.logEvidence}, {S::log(posterior.evidence)}, 0.02);
+    // The threshold network samples from raw draws; checkRawDraws ties its particles to them.
+    checkClose("likelihood weighting, integer thresholds",
+               likelihoodWeighting(thresholdSampler, nodes, evidence, samples, 1).value, posterior.marginals(nodes),
+               0.01);
+    checkClose("likelihood weighting, 1 and 4 workers",
+               likelihoodWeighting(serial, nodes, evidence, samples, 1).value, weighted.value, 1e-12);
+}
+
+void checkRejection(const CompiledNetwork &network, const CompiledNetwork &thresholds, const Evidence &evidence,
+                    const Enumeration &posterior) {
+    constexpr size_t samples{size_t{1} << 20};
+    ThreadPool single(1), pool(4);
+    NetworkSampler serial(network, single), sampler(network, pool), thresholdSampler(thresholds, pool);
+    auto nodes = S::vector<size_t>(network.size());
+    S::iota(nodes.begin(), nodes.end(), size_t{0});
+
+    const auto rejected{rejectionSampling(sampler, nodes, evidence, samples, 2)};
+    checkClose("rejection, posterior", rejected.value, posterior.marginals(nodes), 0.01);
+    checkClose("rejection, P(evidence)", {rejected.acceptanceRate()}, {posterior.evidence}, 0.005);
+    checkClose("rejection, integer thresholds", rejectionSampling(thresholdSampler, nodes, evidence, samples, 2).value,
+               posterior.marginals(nodes), 0.01);
+    check(rejectionSampling(serial, nodes, evidence, samples, 2).value == rejected.value, "rejection, 1 and 4 workers");
+}
+
+void checkGibbs(const CompiledNetwork &network, const Evidence &evidence, const Enumeration &posterior) {
+    ThreadPool single(1), pool(4);
+    NetworkSampler serial(network, single), sampler(network, pool);
+    GibbsSampler gibbs(sampler), serialGibbs(serial);
+    auto nodes = S::vector<size_t>(network.size());
+    S::iota(nodes.begin(), nodes.end(), size_t{0});
+    const auto exact{posterior.marginals(nodes)};
+
+    GibbsOptions options;
+    options.burnIn = 128;
+    options.samples = 256;
+    options.thinning = 2;
+    const auto chains{gibbs.sample(nodes, evidence, options, 3)};
+    checkClose("gibbs, posterior", chains.value, exact, 0.02);
+    check(chains.maxRHat() < 1.1, "gibbs, R-hat " + S::to_string(chains.maxRHat()));
+    check(serialGibbs.sample(nodes, evidence, options, 3).value == chains.value, "gibbs, 1 and 4 workers");
+
+    // Fewer tiles of chains than workers: every color is split over the pool.
+    options.chains = 2 * CompiledNetwork::batchTile;
+    const auto split{gibbs.sample(nodes, evidence, options, 3)};
+    checkClose("gibbs, colors split over workers, posterior", split.value, exact, 0.02);
+    check(serialGibbs.sample(nodes, evidence, options, 3).value == split.value,
+          "gibbs, colors split over workers, 1 and 4 workers");
+}
+
+void checkAdaptiveImportance(const CompiledNetwork &network, const CompiledNetwork &thresholds,
+                             const Evidence &evidence, const Enumeration &prior, const Enumeration &posterior) {
+    ThreadPool single(1), pool(4);
+    NetworkSampler serial(network, single), sampler(network, pool), thresholdSampler(thresholds, pool);
+    AdaptiveImportanceSampler adaptive(sampler), serialAdaptive(serial), thresholdAdaptive(thresholdSampler);
+    const Evidence none(network);
+    auto nodes = S::vector<size_t>(network.size());
+    S::iota(nodes.begin(), nodes.end(), size_t{0});
+    const auto exact{posterior.marginals(nodes)};
+
+    AdaptiveOptions options;
+    options.samplesPerRound = size_t{1} << 12;
+    options.samples = size_t{1} << 18;
+    const auto importance{adaptive.sample(nodes, evidence, options, 4)};
+    checkClose("adaptive importance sampling, posterior", importance.value, exact, 0.01);
+    checkClose("adaptive importance sampling, log P(evidence)", {importance.logEvidence},
+               {S::log(posterior.evidence)}, 0.02);
+    checkClose("adaptive importance sampling, prior", adaptive.sample(nodes, none, options, 4).value,
+               prior.marginals(nodes), 0.01);
+    checkClose("adaptive importance sampling, reused", adaptive.sample(nodes, evidence, options, 4).value,
+               importance.value, 1e-9);
+    checkClose("adaptive importance sampling, 1 and 4 workers",
+               serialAdaptive.sample(nodes, evidence, options, 4).value, importance.value, 1e-9);
+    checkClose("adaptive importance sampling, integer thresholds",
+               thresholdAdaptive.sample(nodes, evidence, options, 4).value, exact, 0.01);
+    options.loopyInit = false;
+    checkClose("adaptive importance sampling, from the CPTs", adaptive.sample(nodes, evidence, options, 4).value,
+               exact, 0.01);
+}
+
+void checkStratification(const CompiledNetwork &thresholds, const Enumeration &prior) {
+    constexpr size_t batch{256}, batches{4}, width{4}, ld{batch * batches};
+    constexpr uint32_t batchBits{8};
+    auto bits = S::vector<uint32_t>(width * ld);
+    const auto strataOf = [&](const StratifiedSampler &s, size_t block, uint32_t shift) {
+        s.fillBlock(0, block, bits.data(), ld, width, ld);
+        auto res = S::vector<uint32_t>(bits.size());
+        for (size_t k{0}; k < bits.size(); k++) res[k] = bits[k] >> shift;
+        return res;
+    };
+    const auto onePerStratum = [&](const uint32_t *strata, size_t count) {
+        auto hits = S::vector<uint32_t>(count);
+        for (size_t i{0}; i < count; i++) hits[strata[i]]++;
+        return S::all_of(hits.begin(), hits.end(), [](auto h) { return h == 1; });
+    };
+
+    // Latin hypercube: in every batch, every node falls once in each of batch strata.
+    auto latin{true};
+    const auto lhs = StratifiedSampler(1, Stratification::latinHypercube, batch);
+    for (size_t block{0}; block < 3; block++) {
+        const auto strata{strataOf(lhs, block, 32 - batchBits)};
+        for (size_t w{0}; w < width; w++)
+            for (size_t b{0}; b < batches; b++) latin &= onePerStratum(strata.data() + w * ld + b * batch, batch);
+    }
+    check(latin, "stratification, latin hypercube batches hit every stratum of every node once");
+
+    // Stratified over two dimensions: every batch puts one sample in each cell of a 16 by 16 grid.
+    auto grid{true};
+    const auto stratified = StratifiedSampler(2, Stratification::stratified, batch, 2);
+    const auto cells{strataOf(stratified, 0, 32 - batchBits / 2)};
+    for (size_t b{0}; b < batches; b++) {
+        auto cell = S::vector<uint32_t>(batch);
+        for (size_t i{0}; i < batch; i++) cell[i] = cells[b * batch + i] << batchBits / 2 | cells[ld + b * batch + i];
+        grid &= onePerStratum(cell.data(), batch);
+    }
+    check(grid, "stratification, stratified batches fill every cell of the grid once");
+
+    const auto antithetic = StratifiedSampler(3, Stratification::antithetic);
+    antithetic.fillBlock(0, 0, bits.data(), ld, width, ld);
+    auto paired{true};
+    for (size_t w{0}; w < width; w++)
+        for (size_t i{0}; i < ld; i += 2) paired &= bits[w * ld + i + 1] == ~bits[w * ld + i];
+    check(paired, "stratification, antithetic pairs are complements");
+
+    auto floats = S::vector<float>(bits.size());
+    lhs.fillBlock(5, 1, bits.data(), 100, width, 100);
+    lhs.fillBlock(5, 1, floats.data(), 100, width, 100);
+    auto consistent{true};
+    for (size_t w{0}; w < width; w++)
+        for (size_t i{0}; i < 100; i++) {
+            const auto u{floats[w * 100 + i]};
+            consistent &= u == uniformFloat(bits[w * 100 + i]) && u == lhs.at(5 + i, 4 + w);
+        }
+    check(consistent, "stratification, float and raw blocks and at() agree");
+
+    // Marginals of the threshold network, whose raw draws come from fillBlock.
+    ThreadPool pool(4);
+    StoppingRule rule{0.005};
+    rule.maxSamples = size_t{1} << 22;
+    auto nodes = S::vector<size_t>(thresholds.size());
+    S::iota(nodes.begin(), nodes.end(), size_t{0});
+    const auto m{NetworkSampler(thresholds, pool).sampleMarginals(nodes, rule, lhs)};
+    const auto widest{*S::max_element(m.halfWidth.begin(), m.halfWidth.end())};
+    check(m.converged && widest <= rule.absoluteError, "stratification, marginals to the requested half-width");
+    checkClose("stratification, prior", m.value, prior.marginals(nodes), 2 * rule.absoluteError);
+}
+
+void checkRaoBlackwell(const CompiledNetwork &network, const Evidence &evidence, const Enumeration &prior,
+                       const Enumeration &posterior) {
+    constexpr size_t samples{size_t{1} << 18};
+    ThreadPool single(1), pool(4);
+    NetworkSampler serial(network, single), sampler(network, pool);
+    RaoBlackwellSampler raoBlackwell(sampler), serialRaoBlackwell(serial);
+    const Evidence none(network);
+    auto nodes = S::vector<size_t>(network.size());
+    S::iota(nodes.begin(), nodes.end(), size_t{0});
+    const auto exact{posterior.marginals(nodes)};
+
+    const auto blackwellized{raoBlackwell.sample(nodes, evidence, samples, 5)};
+    checkClose("rao-blackwell, prior", raoBlackwell.sample(nodes, none, samples, 5).value, prior.marginals(nodes),
+               0.01);
+    checkClose("rao-blackwell, posterior", blackwellized.value, exact, 0.01);
+    checkClose("rao-blackwell, 1 and 4 workers", serialRaoBlackwell.sample(nodes, evidence, samples, 5).value,
+               blackwellized.value, 1e-12);
+
+    // On the particles of likelihood weighting, conditioning can only lower the squared error.
+    constexpr size_t seeds{16}, small{size_t{1} << 12};
+    auto weightedError{0.0}, blackwellizedError{0.0};
+    for (uint64_t seed{0}; seed < seeds; seed++) {
+        const auto w{likelihoodWeighting(sampler, nodes, evidence, small, seed).value};
+        const auto b{raoBlackwell.sample(nodes, evidence, small, seed).value};
+        for (size_t k{0}; k < exact.size(); k++) {
+            weightedError += (w[k] - exact[k]) * (w[k] - exact[k]);
+            blackwellizedError += (b[k] - exact[k]) * (b[k] - exact[k]);
+        }
+    }
+    check(blackwellizedError < weightedError, "rao-blackwell, lower squared error than likelihood weighting, " +
+          S::to_string(blackwellizedError / weightedError) + " of it");
+}
+
+void checkMarginals(const CompiledNetwork &network, const Evidence &evidence, const Enumeration &prior,
+                    const Enumeration &posterior) {
+    constexpr size_t samples{size_t{1} << 18};
+    ThreadPool single(1), pool(4);
+    NetworkSampler serial(network, single), sampler(network, pool);
+    auto nodes = S::vector<size_t>(network.size());
+    S::iota(nodes.begin(), nodes.end(), size_t{0});
+
+    MarginalCounts counts(network, nodes, pool.size()), serialCounts(network, nodes, single.size());
+    // A snapshot taken mid-run must be one whole publication per worker: every node's states sum to 1.
+    S::atomic<bool> running{true};
+    auto whole{true}, growing{true};
+    S::thread reader([&] {
+        size_t last{0};
+        while (running.load()) {
+            const auto snapshot{counts.snapshot()};
+            growing &= snapshot.samples >= last;
+            last = snapshot.samples;
+            if (snapshot.samples == 0) continue;
+            for (size_t q{0}; q < nodes.size(); q++) {
+                const auto first{snapshot.value.begin() + counts.offsets[q]};
+                const auto sum{S::accumulate(first, first + network.arity[nodes[q]], 0.0)};
+                whole &= S::abs(sum - 1) < 1e-9;
+            }
+        }
+    });
+    sampler.accumulate(counts, 0, samples, CounterSampler{8});
+    running = false;
+    reader.join();
+    serial.accumulate(serialCounts, 0, samples, CounterSampler{8});
+    const auto snapshot{counts.snapshot()};
+    check(whole && growing, "marginal counts, snapshots taken while sampling");
+    checkClose("marginal counts, prior", snapshot.value, prior.marginals(nodes), 0.01);
+    check(snapshot.samples == samples && counts.totals() == serialCounts.totals(), "marginal counts, 1 and 4 workers");
+    size_t covered{0};
+    for (size_t k{0}; k < snapshot.value.size(); k++) {
+        const auto [lower, upper] = snapshot.interval(k, 0.999);
+        covered += lower <= prior.marginals(nodes)[k] && prior.marginals(nodes)[k] <= upper;
+    }
+    check(covered + 1 >= snapshot.value.size(), "marginal counts, 99.9% intervals cover the prior, " +
+          S::to_string(covered) + " of " + S::to_string(snapshot.value.size()));
+
+    // Likelihood weighting accumulates the same particles into WeightedCounts.
+    WeightedMarginals weighted(network, nodes, pool.size());
+    sampler.accumulate(weighted, evidence, 0, samples, CounterSampler{1});
+    const auto weightedSnapshot{weighted.snapshot()};
+    const auto direct{likelihoodWeighting(sampler, nodes, evidence, samples, 1)};
+    checkClose("weighted marginals, posterior", weightedSnapshot.value, posterior.marginals(nodes), 0.01);
+    checkClose("weighted marginals, likelihood weighting", weightedSnapshot.value, direct.value, 1e-9);
+    checkClose("weighted marginals, effective samples", {weightedSnapshot.effectiveSamples},
+               {direct.effectiveSamples}, 1e-6 * direct.effectiveSamples);
+}
+
+void checkJointQueries(const CompiledNetwork &network, const Evidence &evidence, const Enumeration &posterior) {
+    constexpr size_t samples{size_t{1} << 18};
+    ThreadPool single(1), pool(4);
+    NetworkSampler serial(network, single), sampler(network, pool);
+    const auto queries = S::vector<JointQuery>{JointQuery(network, {"N1", "N4"}),
+                                               JointQuery(network, {"N8"}, {"N5", "N6"})};
+    for (const size_t denseLimit : {size_t{1} << 16, size_t{0}}) {
+        const S::string layout{denseLimit ? "dense" : "hashed"};
+        JointQueries joint(sampler, queries, denseLimit), serialJoint(serial, queries, denseLimit);
+        const auto answers{joint.sample(evidence, samples, 6)}, serialAnswers{serialJoint.sample(evidence, samples, 6)};
+        for (size_t q{0}; q < queries.size(); q++) {
+            const auto exact{posterior.conditional(queries[q], answers[q], 0.05)};
+            const auto what{"joint query " + S::to_string(q) + ", " + layout};
+            checkClose(what, cellValues(answers[q], exact), exact, 0.02);
+            check(answers[q].cells == serialAnswers[q].cells, what + ", 1 and 4 workers cells");
+            checkClose(what + ", 1 and 4 workers", answers[q].value, serialAnswers[q].value, 1e-12);
+        }
+    }
+}
+
+void checkPackedParticles(const CompiledNetwork &network, const Enumeration &prior) {
+    // Particles that do not fill the last word of a column.
+    constexpr size_t particles{(size_t{1} << 18) / 4 + 77};
+    ThreadPool single(1), pool(4);
+    NetworkSampler serial(network, single), sampler(network, pool);
+    auto nodes = S::vector<size_t>(network.size());
+    S::iota(nodes.begin(), nodes.end(), size_t{0});
+
+    auto states = AlignedVector<State>(network.size() * particles);
+    sampler.sample({states.data(), particles, particles}, 7);
+    PackedParticles packed(network, particles), serialPacked(network, particles);
+    sampler.samplePacked(packed, 0, particles, CounterSampler{7});
+    // Stale bits must not survive into the packed words.
+    serialPacked.words.assign(serialPacked.words.size(), ~uint64_t{0});
+    serial.samplePacked(serialPacked, 0, particles, CounterSampler{7});
+    auto unpacked{true}, counted{true};
+    auto packedMarginals = S::vector<double>();
+    for (size_t n{0}; n < network.size(); n++) {
+        auto column = S::vector<State>(particles);
+        packed.column(n, 3, particles - 3, column.data());
+        unpacked &= S::equal(column.begin(), column.end() - 3, states.data() + n * particles + 3);
+        auto histogram = S::vector<uint64_t>(size_t{1} << packed.width[n]), expected = histogram;
+        packed.addCounts(n, 5, particles - 5, histogram.data());
+        for (size_t i{5}; i < particles; i++) expected[states[n * particles + i]]++;
+        counted &= histogram == expected;
+        for (size_t x{0}; x < network.arity[n]; x++)
+            packedMarginals.push_back(static_cast<double>(histogram[x]) / (particles - 5));
+    }
+    check(unpacked, "packed particles, unpacked columns");
+    check(counted, "packed particles, counts");
+    checkClose("packed particles, prior", packedMarginals, prior.marginals(nodes), 0.01);
+    check(serialPacked.words == packed.words, "packed particles, 1 and 4 workers");
+}
+
+int main(int argc, char *argv[]) {
+    const S::string file{argc > 1 ? argv[1] : "networks/SamplerTestBN.xdsl"};
+    const BN_Network raw(file);
+    const CompiledNetwork network(raw), thresholds(raw, true);
+    const Evidence none(network), evidence(network, {{"N9", "s1"}, {"N3", "s0"}});
+    const Enumeration prior(raw, network, none), posterior(raw, network, evidence);
+
+    checkCompiledNetwork(raw, network, prior);
+    checkBatchSampling(network, prior);
+    checkAliasRows(raw, network);
+    checkSelectionKernels(network);
+    checkPcgLanes();
+    checkThresholdRows(raw, thresholds);
+    checkRawDraws(thresholds, prior);
+    checkCounterSampler(network);
+    checkThreadPool();
+    checkPlacement();
+    checkVegas();
+    checkSobol();
+    checkStoppingRule(network, prior);
+    checkCompensatedSum();
+    checkContextPool();
+    checkLikelihoodWeighting(network, thresholds, evidence, prior, posterior);
+    checkRejection(network, thresholds, evidence, posterior);
+    checkGibbs(network, evidence, posterior);
+    checkAdaptiveImportance(network, thresholds, evidence, prior, posterior);
+    checkStratification(thresholds, prior);
+    checkRaoBlackwell(network, evidence, prior, posterior);
+    checkMarginals(network, evidence, prior, posterior);
+    checkJointQueries(network, evidence, posterior);
+    checkPackedParticles(network, prior);
+
+    S::cout << '\n' << (failures ? S::to_string(failures) + " checks failed" : "all checks passed") << '\n';
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+namespace S = std;
+
+// State selection for cumulative rows of at most 16 states, padded above 1 to 8 or 16 aligned values: the state
+// drawn by u is the number of thresholds <= u. The uint32_t overloads take integer thresholds and raw draws.
+
+inline uint32_t selectState8(const float *row, const float sample) {
+#ifdef __AVX2__
+    const auto le{_mm256_cmp_ps(_mm256_load_ps(row), _mm256_set1_ps(sample), _CMP_LE_OQ)};
+    return S::popcount(static_cast<uint32_t>(_mm256_movemask_ps(le)));
+#else
+    uint32_t state{0};
+    for (size_t j{0}; j < 8; j++) state += row[j] <= sample;
+    return state;
+#endif
+}
+
+inline uint32_t selectState16(const float *row, const float sample) {
+#ifdef __AVX512F__
+    return S::popcount(static_cast<uint32_t>(
+            _mm512_cmp_ps_mask(_mm512_load_ps(row), _mm512_set1_ps(sample), _CMP_LE_OQ)));
+#else
+    return selectState8(row, sample) + selectState8(row + 8, sample);
+#endif
+}
+
+// One row shared by the whole batch, for nodes without parents.
+inline void selectStatesShared(const float *row, uint32_t arity, const float *samples, uint32_t *states,
+                               size_t count) {
+    size_t i{0};
+#if defined(__AVX512F__)
+    for (; i + 16 <= count; i += 16) {
+        const auto u{_mm512_loadu_ps(samples + i)};
+        auto acc{_mm512_setzero_si512()};
+        for (uint32_t j{0}; j + 1 < arity; j++) {
+            const auto le{_mm512_cmp_ps_mask(_mm512_set1_ps(row[j]), u, _CMP_LE_OQ)};
+            acc = _mm512_mask_add_epi32(acc, le, acc, _mm512_set1_epi32(1));
+        }
+        _mm512_storeu_si512(states + i, acc);
+    }
+#elif defined(__AVX2__)
+    for (; i + 8 <= count; i += 8) {
+        const auto u{_mm256_loadu_ps(samples + i)};
+        auto acc{_mm256_setzero_si256()};
+        for (uint32_t j{0}; j + 1 < arity; j++)
+            acc = _mm256_sub_epi32(acc, _mm256_castps_si256(_mm256_cmp_ps(_mm256_set1_ps(row[j]), u, _CMP_LE_OQ)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(states + i), acc);
+    }
+#endif
+    for (; i < count; i++) {
+        uint32_t state{0};
+        for (uint32_t j{0}; j + 1 < arity; j++) state += row[j] <= samples[i];
+        states[i] = state;
+    }
+}
+
+// Each particle reads its own row at base + offsets[i]; thresholds are gathered one column at a time.
+inline void selectStatesGather(const float *base, const uint32_t *offsets, uint32_t arity, const float *samples,
+                               uint32_t *states, size_t count) {
+    size_t i{0};
+#if defined(__AVX512F__)
+    for (; i + 16 <= count; i += 16) {
+        const auto u{_mm512_loadu_ps(samples + i)};
+        const auto rows{_mm512_loadu_si512(offsets + i)};
+        auto acc{_mm512_setzero_si512()};
+        for (uint32_t j{0}; j + 1 < arity; j++) {
+            const auto index{_mm512_add_epi32(rows, _mm512_set1_epi32(j))};
+            const auto t{_mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF, index, base, 4)};
+            acc = _mm512_mask_add_epi32(acc, _mm512_cmp_ps_mask(t, u, _CMP_LE_OQ), acc, _mm512_set1_epi32(1));
+        }
+        _mm512_storeu_si512(states + i, acc);
+    }
+#elif defined(__AVX2__)
+    for (; i + 8 <= count; i += 8) {
+        const auto u{_mm256_loadu_ps(samples + i)};
+        const auto rows{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(offsets + i))};
+        auto acc{_mm256_setzero_si256()};
+        for (uint32_t j{0}; j + 1 < arity; j++) {
+            const auto t{_mm256_i32gather_ps(base, _mm256_add_epi32(rows, _mm256_set1_epi32(j)), 4)};
+            acc = _mm256_sub_epi32(acc, _mm256_castps_si256(_mm256_cmp_ps(t, u, _CMP_LE_OQ)));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(states + i), acc);
+    }
+#endif
+    for (; i < count; i++) {
+        const auto row{base + offsets[i]};
+        uint32_t state{0};
+        for (uint32_t j{0}; j + 1 < arity; j++) state += row[j] <= samples[i];
+        states[i] = state;
+    }
+}
+
+inline uint32_t selectState(const uint32_t *row, uint32_t arity, const uint32_t draw) {
+    uint32_t state{0};
+    for (uint32_t j{0}; j + 1 < arity; j++) state += row[j] <= draw;
+    return state;
+}
+
+inline void selectStatesShared(const uint32_t *row, uint32_t arity, const uint32_t *draws, uint32_t *states,
+                               size_t count) {
+    size_t i{0};
+#if defined(__AVX512F__)
+    for (; i + 16 <= count; i += 16) {
+        const auto d{_mm512_loadu_si512(draws + i)};
+        auto acc{_mm512_setzero_si512()};
+        for (uint32_t j{0}; j + 1 < arity; j++) {
+            const auto le{_mm512_cmp_epu32_mask(_mm512_set1_epi32(static_cast<int>(row[j])), d, _MM_CMPINT_LE)};
+            acc = _mm512_mask_add_epi32(acc, le, acc, _mm512_set1_epi32(1));
+        }
+        _mm512_storeu_si512(states + i, acc);
+    }
+#elif defined(__AVX2__)
+    // AVX2 has no unsigned compare: flipping the sign bit maps unsigned order onto signed order.
+    const auto sign{_mm256_set1_epi32(static_cast<int>(0x80000000u))};
+    for (; i + 8 <= count; i += 8) {
+        const auto d{_mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(draws + i)), sign)};
+        auto above{_mm256_setzero_si256()};
+        for (uint32_t j{0}; j + 1 < arity; j++) {
+            const auto t{_mm256_xor_si256(_mm256_set1_epi32(static_cast<int>(row[j])), sign)};
+            above = _mm256_sub_epi32(above, _mm256_cmpgt_epi32(t, d));
+        }
+        const auto state{_mm256_sub_epi32(_mm256_set1_epi32(static_cast<int>(arity - 1)), above)};
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(states + i), state);
+    }
+#endif
+    for (; i < count; i++) states[i] = selectState(row, arity, draws[i]);
+}
+
+inline void selectStatesGather(const uint32_t *base, const uint32_t *offsets, uint32_t arity, const uint32_t *draws,
+                               uint32_t *states, size_t count) {
+    size_t i{0};
+#if defined(__AVX512F__)
+    for (; i + 16 <= count; i += 16) {
+        const auto d{_mm512_loadu_si512(draws + i)};
+        const auto rows{_mm512_loadu_si512(offsets + i)};
+        auto acc{_mm512_setzero_si512()};
+        for (uint32_t j{0}; j + 1 < arity; j++) {
+            const auto index{_mm512_add_epi32(rows, _mm512_set1_epi32(j))};
+            const auto t{_mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF, index, base, 4)};
+            acc = _mm512_mask_add_epi32(acc, _mm512_cmp_epu32_mask(t, d, _MM_CMPINT_LE), acc, _mm512_set1_epi32(1));
+        }
+        _mm512_storeu_si512(states + i, acc);
+    }
+#elif defined(__AVX2__)
+    const auto sign{_mm256_set1_epi32(static_cast<int>(0x80000000u))};
+    for (; i + 8 <= count; i += 8) {
+        const auto d{_mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(draws + i)), sign)};
+        const auto rows{_mm256_loadu_si256(reinterpret_cast<const __m256i *>(offsets + i))};
+        auto above{_mm256_setzero_si256()};
+        for (uint32_t j{0}; j + 1 < arity; j++) {
+            const auto index{_mm256_add_epi32(rows, _mm256_set1_epi32(static_cast<int>(j)))};
+            const auto t{_mm256_i32gather_epi32(reinterpret_cast<const int *>(base), index, 4)};
+            above = _mm256_sub_epi32(above, _mm256_cmpgt_epi32(_mm256_xor_si256(t, sign), d));
+        }
+        const auto state{_mm256_sub_epi32(_mm256_set1_epi32(static_cast<int>(arity - 1)), above)};
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(states + i), state);
+    }
+#endif
+    for (; i < count; i++) states[i] = selectState(base + offsets[i], arity, draws[i]);
+}
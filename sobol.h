@@ -0,0 +1,176 @@
+#pragma once
+
+#include <bit>
+#include <vector>
+#include <cstdint>
+#include <cassert>
+
+#include "rng.h"
+
+namespace S = std;
+
+// Direction numbers of a Sobol sequence in any number of dimensions, from the primitive polynomials over GF(2)
+// in order and initial numbers drawn from a fixed Philox stream.
+struct SobolDirections {
+    static constexpr size_t bits{32};
+
+    size_t dimensions;
+    // directions[d * bits + k] is v_k of dimension d, the point of index 2^k.
+    S::vector<uint32_t> directions;
+    // steps[d * bits + k] = v_0 ^ ... ^ v_k: going from index i to i + 1 flips bits 0..k, k = countr_zero(i + 1).
+    S::vector<uint32_t> steps;
+
+    static uint64_t multiplyMod(uint64_t a, uint64_t b, uint64_t polynomial, unsigned degree) {
+        uint64_t res{0};
+        for (; b; b >>= 1) {
+            if (b & 1) res ^= a;
+            a <<= 1;
+            if (a >> degree & 1) a ^= polynomial;
+        }
+        return res;
+    }
+
+    static uint64_t powerOfX(uint64_t exponent, uint64_t polynomial, unsigned degree) {
+        uint64_t res{1}, base{degree == 1 ? 2 ^ polynomial : 2};
+        for (; exponent; exponent >>= 1) {
+            if (exponent & 1) res = multiplyMod(res, base, polynomial, degree);
+            base = multiplyMod(base, base, polynomial, degree);
+        }
+        return res;
+    }
+
+    // x generates the multiplicative group of GF(2^degree) = GF(2)[x] / polynomial.
+    static bool isPrimitive(uint64_t polynomial, unsigned degree) {
+        const auto order{(uint64_t{1} << degree) - 1};
+        if (powerOfX(order, polynomial, degree) != 1) return false;
+        auto rest{order};
+        for (uint64_t q{2}; q * q <= rest; q++) {
+            if (rest % q) continue;
+            if (powerOfX(order / q, polynomial, degree) == 1) return false;
+            while (rest % q == 0) rest /= q;
+        }
+        return rest == 1 || rest == order || powerOfX(order / rest, polynomial, degree) != 1;
+    }
+
+    explicit SobolDirections(size_t dimensions) :
+            dimensions(dimensions), directions(dimensions * bits), steps(dimensions * bits) {
+        const auto initial{CounterSampler{0x50B01ULL}};
+        unsigned degree{1};
+        uint64_t polynomial{1};
+
+        for (size_t d{0}; d < dimensions; d++) {
+            const auto v{directions.begin() + d * bits};
+            if (d == 0) {
+                for (unsigned k{0}; k < bits; k++) v[k] = 1u << (31 - k);
+            } else {
+                do {
+                    polynomial += 2;
+                    if (polynomial >> (degree + 1)) polynomial = (uint64_t{2} << degree++) | 1;
+                } while (!isPrimitive(polynomial, degree));
+                assert(degree < bits);
+
+                S::vector<uint32_t> m(bits);
+                for (unsigned k{0}; k < degree; k++) m[k] = (initial.bits(d, k / 4)[k % 4] & ((2u << k) - 1)) | 1u;
+                // m_k = 2 a_1 m_{k-1} ^ 4 a_2 m_{k-2} ^ ... ^ 2^s m_{k-s} ^ m_{k-s}, a_j the coefficient of x^(s-j).
+                for (unsigned k{degree}; k < bits; k++) {
+                    m[k] = m[k - degree] ^ (m[k - degree] << degree);
+                    for (unsigned j{1}; j < degree; j++)
+                        if (polynomial >> (degree - j) & 1) m[k] ^= m[k - j] << j;
+                }
+                for (unsigned k{0}; k < bits; k++) v[k] = m[k] << (31 - k);
+            }
+            uint32_t prefix{0};
+            for (unsigned k{0}; k < bits; k++) steps[d * bits + k] = prefix ^= v[k];
+        }
+    }
+
+    // Unscrambled point of any index below 2^32.
+    [[nodiscard]] uint32_t point(uint64_t index, size_t dimension) const {
+        assert(index >> bits == 0);
+        uint32_t x{0};
+        for (auto v{directions.begin() + dimension * bits}; index; index >>= 1, ++v) if (index & 1) x ^= *v;
+        return x;
+    }
+
+    [[nodiscard]] uint32_t next(uint32_t x, uint64_t index, size_t dimension) const {
+        return x ^ steps[dimension * bits + S::countr_zero(index + 1)];
+    }
+};
+
+// One Owen-scrambled randomization of a Sobol sequence; dimension d of point i is the d-th uniform of sample i.
+struct SobolSampler {
+    const SobolDirections &directions;
+    S::vector<uint32_t> scrambles;
+
+    SobolSampler(const SobolDirections &directions, uint64_t seed, uint64_t randomization = 0) :
+            directions(directions), scrambles(directions.dimensions) {
+        const auto s{CounterSampler{seed}};
+        for (size_t d{0}; d < scrambles.size(); d++) scrambles[d] = s.bits(randomization, d / 4)[d % 4];
+    }
+
+    static uint32_t reverseBits(uint32_t x) {
+        x = (x >> 1 & 0x55555555u) | (x & 0x55555555u) << 1;
+        x = (x >> 2 & 0x33333333u) | (x & 0x33333333u) << 2;
+        x = (x >> 4 & 0x0F0F0F0Fu) | (x & 0x0F0F0F0Fu) << 4;
+        return __builtin_bswap32(x);
+    }
+
+    // Hash-based nested uniform scramble of x.
+    static uint32_t scramble(uint32_t x, uint32_t seed) {
+        x = reverseBits(x);
+        x ^= x * 0x3D20ADEAu;
+        x += seed;
+        x *= (seed >> 16) | 1u;
+        x ^= x * 0x05526C56u;
+        x ^= x * 0x53A22864u;
+        return reverseBits(x);
+    }
+
+    [[nodiscard]] uint32_t bits(uint64_t index, size_t dimension) const {
+        return scramble(directions.point(index, dimension), scrambles[dimension]);
+    }
+
+    [[nodiscard]] float at(uint64_t index, size_t dimension) const { return uniformFloat(bits(index, dimension)); }
+
+    void fill(uint64_t index, float *out, size_t dimensions) const {
+        assert(dimensions <= directions.dimensions);
+        for (size_t d{0}; d < dimensions; d++) out[d] = at(index, d);
+    }
+
+    void fill(uint64_t index, uint32_t *out, size_t dimensions) const {
+        assert(dimensions <= directions.dimensions);
+        for (size_t d{0}; d < dimensions; d++) out[d] = bits(index, d);
+    }
+
+    // Dimension d of points [first, first + count), stepping from point to point instead of rebuilding each one.
+    void fillDimension(uint64_t first, size_t dimension, uint32_t *out, size_t count) const {
+        auto x{directions.point(first, dimension)};
+        for (size_t i{0}; i < count; i++) {
+            out[i] = scramble(x, scrambles[dimension]);
+            if (i + 1 < count) x = directions.next(x, first + i, dimension);
+        }
+    }
+
+    void fillDimension(uint64_t first, size_t dimension, float *out, size_t count) const {
+        auto x{directions.point(first, dimension)};
+        for (size_t i{0}; i < count; i++) {
+            out[i] = uniformFloat(scramble(x, scrambles[dimension]));
+            if (i + 1 < count) x = directions.next(x, first + i, dimension);
+        }
+    }
+};
+
+// Sequential drop-in for Sampler: successive fill() calls return successive points of one randomization.
+struct SobolStream {
+    SobolSampler sampler;
+    uint64_t index{0};
+
+    SobolStream(const SobolDirections &directions, uint64_t seed, uint64_t randomization = 0) :
+            sampler(directions, seed, randomization) {}
+
+    inline void fill(S::vector<float> &s) { sampler.fill(index++, s.data(), s.size()); }
+
+    inline void fill(S::vector<uint32_t> &s) { sampler.fill(index++, s.data(), s.size()); }
+
+    inline void fill(float *s, size_t count) { sampler.fill(index++, s, count); }
+};
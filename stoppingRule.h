@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+
+namespace S = std;
+
+// Running mean and sum of squared deviations; merge() combines the moments of disjoint sample sets.
+struct RunningMoments {
+    size_t count{0};
+    double mean{0};
+    double m2{0};
+
+    inline void add(double x) {
+        count++;
+        const auto delta{x - mean};
+        mean += delta / count;
+        m2 += delta * (x - mean);
+    }
+
+    // Moments of count values from their sums and sums of squares after subtracting shift, best near the mean.
+    static RunningMoments fromShiftedSums(size_t count, double shift, double sum, double sumSquares) {
+        if (count == 0) return {};
+        return {count, shift + sum / count, S::max(sumSquares - sum * sum / count, 0.0)};
+    }
+
+    void merge(const RunningMoments &other) {
+        if (other.count == 0) return;
+        const auto total{count + other.count};
+        const auto delta{other.mean - mean};
+        mean += delta * other.count / total;
+        m2 += other.m2 + delta * delta * count * other.count / total;
+        count = total;
+    }
+
+    [[nodiscard]] double variance() const { return count > 1 ? m2 / (count - 1) : 0.0; }
+};
+
+// Inverse of the standard normal CDF by bisection on erfc; only used once per query.
+inline double normalQuantile(double p) {
+    double lo{-40}, hi{40};
+    for (size_t i{0}; i < 200 && hi - lo > 1e-12; i++) {
+        const auto mid{(lo + hi) / 2};
+        (0.5 * S::erfc(-mid / S::sqrt(2.0)) < p ? lo : hi) = mid;
+    }
+    return (lo + hi) / 2;
+}
+
+// Sample until every estimate x has z * sqrt(v / n) <= max(absoluteError, relativeError * |x|); zero targets are
+// ignored, and with both zero the rule runs to the cap.
+struct StoppingRule {
+    double absoluteError{0};
+    double relativeError{0};
+    double confidence{0.95};
+    // 0 leaves the cap to the caller: the network's numsamples for queries, defaultMaxSamples otherwise.
+    size_t maxSamples{0};
+    size_t firstRound{size_t{1} << 14};
+
+    static constexpr size_t defaultMaxSamples{size_t{1} << 26};
+
+    [[nodiscard]] double z() const { return normalQuantile(0.5 + confidence / 2); }
+
+    [[nodiscard]] size_t cap(size_t fallback) const {
+        return maxSamples ? maxSamples : fallback ? fallback : defaultMaxSamples;
+    }
+
+    [[nodiscard]] double target(double estimate) const {
+        return S::max(absoluteError, relativeError * S::abs(estimate));
+    }
+
+    // halfWidth / target, kept finite for -ffast-math: an estimate with a zero target and any spread is far off.
+    [[nodiscard]] double ratio(double halfWidth, double estimate) const {
+        const auto t{target(estimate)};
+        return halfWidth <= 0 ? 0.0 : t > 0 ? halfWidth / t : 1e30;
+    }
+
+    // Samples to add after samples so far, given the largest ratio halfWidth / target over the estimates.
+    [[nodiscard]] size_t nextRound(size_t samples, double worstRatio, size_t cap) const {
+        if (samples == 0) return S::min(firstRound, cap);
+        const auto needed{static_cast<double>(samples) * worstRatio * worstRatio * 1.1};
+        const auto more{needed > static_cast<double>(cap) ? cap : static_cast<size_t>(needed)};
+        return S::min(S::max({more > samples ? more - samples : 0, samples / 4, firstRound}), cap - samples);
+    }
+
+    // Calls round(first, count), in multiples of granularity, until ratio(samples) <= 1 or cap samples are drawn;
+    // returns the samples drawn and whether the targets were met.
+    template<typename Round, typename Ratio>
+    S::pair<size_t, bool> run(size_t cap, Round &&round, Ratio &&worstRatio, size_t granularity = 1) const {
+        cap -= cap % granularity;
+        size_t samples{0};
+        for (auto ratio{0.0};;) {
+            const auto count{(nextRound(samples, ratio, cap) + granularity - 1) / granularity * granularity};
+            if (count == 0) return {samples, false};
+            round(samples, count);
+            samples += count;
+            ratio = worstRatio(samples);
+            if (ratio <= 1) return {samples, true};
+        }
+    }
+};
+
+struct SequentialResult {
+    S::vector<double> value;
+    // Half width of the confidence interval at the rule's level.
+    S::vector<double> halfWidth;
+    size_t samples{0};
+    // False when the cap was reached first.
+    bool converged{false};
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+#include <algorithm>
+
+#include "rng.h"
+
+namespace S = std;
+
+enum class Stratification {
+    // Independent uniforms, as CounterSampler.
+    none,
+    // The leading nodes share one grid of strata^dimensions cells, one particle of every batch in each.
+    stratified,
+    // Every node has batch strata, one particle of every batch in each.
+    latinHypercube,
+    // Particles come in pairs (u, 1 - u).
+    antithetic,
+};
+
+// Uniforms addressed like CounterSampler but correlated within batches of consecutive samples. Batches are
+// independent, so error bars must come from the spread of batch means.
+struct StratifiedSampler {
+    // Philox counter blocks above this one hold the permutations of each batch.
+    static constexpr uint64_t permutationBlocks{uint64_t{1} << 32};
+
+    CounterSampler s;
+    Stratification scheme;
+    // Samples per batch: a power of two; 1 with independent uniforms and 2 with antithetic pairs.
+    size_t batch;
+    // Dimensions sharing the grid of stratified, and log2 of its strata per dimension.
+    size_t dimensions;
+    uint32_t strataBits;
+
+    // A batch of batch samples; stratified splits it into batch^(1 / dimensions) strata per dimension.
+    explicit StratifiedSampler(uint64_t seed, Stratification scheme = Stratification::latinHypercube,
+                               size_t batch = 256, size_t dimensions = 1) :
+            s{seed}, scheme(scheme),
+            batch(scheme == Stratification::none ? 1 : scheme == Stratification::antithetic ? 2 : batch),
+            dimensions(scheme == Stratification::stratified ? dimensions : 1),
+            strataBits(S::countr_zero(this->batch) / this->dimensions) {
+        assert(S::has_single_bit(this->batch) && this->dimensions > 0);
+        assert(scheme != Stratification::stratified || strataBits * dimensions == static_cast<size_t>(S::countr_zero(batch)));
+        assert(scheme == Stratification::none || this->batch > 1);
+    }
+
+    // Raw draws of dimensions [4 block, 4 block + width) of samples [first, first + count), dimension 4 block + w
+    // of sample first + i going to out[w * ld + i].
+    void fillBlock(uint64_t first, uint64_t block, uint32_t *out, size_t ld, size_t width, size_t count) const {
+        const auto mask{static_cast<uint32_t>(batch - 1)};
+        const auto batchBits{static_cast<uint32_t>(S::countr_zero(batch))};
+        Philox::Block permutation{};
+        auto current{~uint64_t{0}};
+        for (size_t i{0}; i < count; i++) {
+            const auto sample{first + i};
+            if (scheme == Stratification::antithetic) {
+                const auto jitter{s.bits(sample >> 1, block)};
+                const auto flip{sample & 1 ? ~uint32_t{0} : 0u};
+                for (size_t w{0}; w < width; w++) out[w * ld + i] = jitter[w] ^ flip;
+                continue;
+            }
+            const auto jitter{s.bits(sample, block)};
+            if (scheme == Stratification::none || (scheme == Stratification::stratified && 4 * block >= dimensions)) {
+                for (size_t w{0}; w < width; w++) out[w * ld + i] = jitter[w];
+                continue;
+            }
+            if (sample / batch != current) {
+                current = sample / batch;
+                permutation = s.bits(current, permutationBlocks + (scheme == Stratification::stratified ? 0 : block));
+            }
+            const auto j{static_cast<uint32_t>(sample) & mask};
+            const auto permute = [&](uint32_t word) { return ((word >> 16 << 1 | 1) * j + word) & mask; };
+            if (scheme == Stratification::latinHypercube) {
+                for (size_t w{0}; w < width; w++)
+                    out[w * ld + i] = permute(permutation[w]) << (32 - batchBits) | jitter[w] >> batchBits;
+                continue;
+            }
+            // One permutation of the cells, whose digits are the strata of the leading dimensions.
+            const auto cell{permute(permutation[0])}, strata{(uint32_t{1} << strataBits) - 1};
+            for (size_t w{0}; w < width; w++) {
+                const auto d{4 * block + w};
+                out[w * ld + i] = d < dimensions ? (cell >> (d * strataBits) & strata) << (32 - strataBits) |
+                                                   jitter[w] >> strataBits : jitter[w];
+            }
+        }
+    }
+
+    void fillBlock(uint64_t first, uint64_t block, float *out, size_t ld, size_t width, size_t count) const {
+        constexpr size_t step{64};
+        uint32_t bits[4 * step];
+        for (size_t done{0}; done < count; done += step) {
+            const auto n{S::min(step, count - done)};
+            fillBlock(first + done, block, bits, step, width, n);
+            for (size_t w{0}; w < width; w++)
+                for (size_t i{0}; i < n; i++) out[w * ld + done + i] = uniformFloat(bits[w * step + i]);
+        }
+    }
+
+    [[nodiscard]] float at(uint64_t sample, uint64_t dimension) const {
+        float u[4];
+        fillBlock(sample, dimension / 4, u, 1, 4, 1);
+        return u[dimension % 4];
+    }
+};
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cassert>
+#include <limits>
+#include <condition_variable>
+
+#include "topology.h"
+
+namespace S = std;
+
+constexpr size_t cacheLine{64};
+
+// Keeps per-worker state on its own cache line so workers never false-share.
+template<typename T>
+struct alignas(cacheLine) Padded {
+    T value{};
+};
+
+// Resizes a per-worker buffer with a cache line of spare capacity, so two such buffers never share a line.
+template<typename T, typename Allocator>
+void resizePadded(S::vector<T, Allocator> &v, size_t size) {
+    v.reserve(size + (cacheLine + sizeof(T) - 1) / sizeof(T));
+    v.resize(size);
+}
+
+// Contiguous run of chunk indices owned by one worker; the owner takes from the front, thieves from the back.
+struct alignas(cacheLine) ChunkRange {
+    S::atomic<uint64_t> bounds{0};
+
+    static uint64_t pack(uint32_t front, uint32_t back) { return uint64_t{back} << 32 | front; }
+
+    void reset(uint32_t front, uint32_t back) { bounds.store(pack(front, back), S::memory_order_relaxed); }
+
+    bool popFront(size_t &chunk) {
+        auto current{bounds.load(S::memory_order_relaxed)};
+        for (;;) {
+            const auto front{static_cast<uint32_t>(current)}, back{static_cast<uint32_t>(current >> 32)};
+            if (front >= back) return false;
+            if (bounds.compare_exchange_weak(current, pack(front + 1, back), S::memory_order_acq_rel)) {
+                chunk = front;
+                return true;
+            }
+        }
+    }
+
+    bool stealBack(size_t &chunk) {
+        auto current{bounds.load(S::memory_order_relaxed)};
+        for (;;) {
+            const auto front{static_cast<uint32_t>(current)}, back{static_cast<uint32_t>(current >> 32)};
+            if (front >= back) return false;
+            if (bounds.compare_exchange_weak(current, pack(front, back - 1), S::memory_order_acq_rel)) {
+                chunk = back - 1;
+                return true;
+            }
+        }
+    }
+};
+
+// Long-lived work-stealing pool of size() workers, the thread calling parallelFor being worker 0. The pool runs
+// one job at a time: parallelFor calls from several threads wait on jobLock and run one after another, so
+// concurrent users wanting to overlap need pools of their own. parallelFor may not be called from inside a job.
+class ThreadPool {
+    typedef void (*Trampoline)(void *, size_t, size_t);
+
+    Topology topology;
+    // Planned CPU of every worker, and whether pinning the worker to it succeeded.
+    S::vector<CpuInfo> pinned;
+    S::vector<bool> isPinned;
+    S::vector<S::thread> threads;
+    S::vector<ChunkRange> ranges;
+
+    S::mutex jobLock;
+    S::mutex stateLock;
+    S::condition_variable wake;
+    S::condition_variable done;
+    size_t generation{0};
+    size_t pending{0};
+    bool stopping{false};
+
+    Trampoline trampoline{nullptr};
+    void *job{nullptr};
+
+    void runChunks(size_t worker) {
+        size_t chunk;
+        while (ranges[worker].popFront(chunk)) trampoline(job, worker, chunk);
+        for (size_t offset{1}; offset < ranges.size(); offset++) {
+            auto &victim{ranges[(worker + offset) % ranges.size()]};
+            while (victim.stealBack(chunk)) trampoline(job, worker, chunk);
+        }
+    }
+
+    void workerLoop(size_t worker) {
+        size_t seen{0};
+        for (;;) {
+            {
+                S::unique_lock<S::mutex> lock{stateLock};
+                wake.wait(lock, [&]() { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+            runChunks(worker);
+            S::lock_guard<S::mutex> lock{stateLock};
+            if (--pending == 0) done.notify_one();
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t workers = S::max(1u, S::thread::hardware_concurrency())) : ranges(workers) {
+        for (size_t w{1}; w < workers; w++) threads.emplace_back([this, w]() { workerLoop(w); });
+    }
+
+    ThreadPool(const Topology &topology, Placement placement) :
+            topology(topology),
+            pinned(placement == Placement::Unpinned ? S::vector<CpuInfo>{} : topology.workerCpus(placement)),
+            isPinned(pinned.size()), ranges(pinned.empty() ? topology.cpus.size() : pinned.size()) {
+        for (size_t w{1}; w < ranges.size(); w++) {
+            threads.emplace_back([this, w]() { workerLoop(w); });
+            // A worker the kernel will not pin stays where the scheduler puts it.
+            if (!pinned.empty()) isPinned[w] = pinThread(threads.back(), {pinned[w].cpu});
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            S::lock_guard<S::mutex> lock{stateLock};
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &t : threads) t.join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    [[nodiscard]] size_t size() const { return ranges.size(); }
+
+    [[nodiscard]] const Topology &layout() const { return topology; }
+
+    // NUMA node the worker is running on; 0 when the topology is unknown.
+    [[nodiscard]] size_t numaNode(size_t worker) const {
+        if (worker != 0 && !pinned.empty() && isPinned[worker]) return pinned[worker].numaNode;
+        const auto info{topology.find(currentCpu())};
+        return info ? info->numaNode : 0;
+    }
+
+    // Calls fn(worker, chunk) once for every chunk in [0, chunks) and returns when all calls have finished.
+    // worker is in [0, size()) and no two concurrent calls share it, so it can index per-worker state.
+    template<typename Function>
+    void parallelFor(size_t chunks, Function &&fn) {
+        if (chunks == 0) return;
+        S::lock_guard<S::mutex> serial{jobLock};
+        assert(chunks < S::numeric_limits<uint32_t>::max());
+
+        const auto workers{size()};
+        for (size_t w{0}; w < workers; w++) ranges[w].reset(chunks * w / workers, chunks * (w + 1) / workers);
+
+        typedef S::remove_reference_t<Function> F;
+        trampoline = [](void *f, size_t worker, size_t chunk) { (*static_cast<F *>(f))(worker, chunk); };
+        job = const_cast<void *>(static_cast<const void *>(&fn));
+        {
+            S::lock_guard<S::mutex> lock{stateLock};
+            pending = threads.size();
+            generation++;
+        }
+        wake.notify_all();
+
+        runChunks(0);
+        S::unique_lock<S::mutex> lock{stateLock};
+        done.wait(lock, [&]() { return pending == 0; });
+    }
+
+    static ThreadPool &global() {
+        static ThreadPool pool{};
+        return pool;
+    }
+};
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <fstream>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+#include "functional_helpers.hpp"
+
+namespace S = std;
+
+enum class Placement {
+    // Threads are left to the scheduler.
+    Unpinned,
+    // One pinned worker per logical CPU; SMT siblings come after every physical core has a worker.
+    AllThreads,
+    // One pinned worker per physical core.
+    PhysicalCores,
+};
+
+struct CpuInfo {
+    unsigned cpu;
+    unsigned core;
+    unsigned package;
+    unsigned numaNode;
+};
+
+// Layout of the CPUs the process may run on, read from /sys/devices/system; without it, one NUMA node of
+// single-thread cores.
+struct Topology {
+    S::vector<CpuInfo> cpus;
+    size_t numaNodes{1};
+
+    // Parses the kernel's cpulist format, e.g. "0-3,8,10-11".
+    static S::vector<unsigned> parseCpuList(const S::string &list) {
+        S::vector<unsigned> res;
+        for (const auto &range : splitString(list, ",")) {
+            const auto dash{range.find('-')};
+            const auto first{static_cast<unsigned>(S::stoul(range.substr(0, dash)))};
+            const auto last{dash == S::string::npos ? first : static_cast<unsigned>(S::stoul(range.substr(dash + 1)))};
+            for (auto cpu{first}; cpu <= last; cpu++) res.push_back(cpu);
+        }
+        return res;
+    }
+
+    static S::string readLine(const S::string &path) {
+        S::ifstream file{path};
+        S::string line;
+        S::getline(file, line);
+        return line;
+    }
+
+    static unsigned readUnsigned(const S::string &path, unsigned fallback) {
+        const auto line{readLine(path)};
+        return line.empty() ? fallback : static_cast<unsigned>(S::stoul(line));
+    }
+
+    // CPUs in the affinity mask of the calling thread, which new threads inherit; empty when unknown.
+    static S::vector<unsigned> allowedCpus() {
+        S::vector<unsigned> res;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) return res;
+        for (unsigned cpu{0}; cpu < CPU_SETSIZE; cpu++) if (CPU_ISSET(cpu, &set)) res.push_back(cpu);
+#endif
+        return res;
+    }
+
+    static Topology detect() {
+        const S::string root{"/sys/devices/system/"};
+        Topology topology;
+
+        auto online{parseCpuList(readLine(root + "cpu/online"))};
+        if (online.empty())
+            for (unsigned cpu{0}; cpu < S::max(1u, S::thread::hardware_concurrency()); cpu++) online.push_back(cpu);
+        // Workers are never placed on CPUs that taskset or a cpuset keep the process off.
+        const auto allowed{allowedCpus()};
+        auto usable{online};
+        S::erase_if(usable, [&](auto cpu) { return S::find(allowed.begin(), allowed.end(), cpu) == allowed.end(); });
+        if (!usable.empty()) online = usable;
+
+        for (const auto cpu : online) {
+            const auto dir{root + "cpu/cpu" + S::to_string(cpu) + "/topology/"};
+            const auto package{readUnsigned(dir + "physical_package_id", 0)};
+            topology.cpus.push_back({cpu, readUnsigned(dir + "core_id", cpu), package, 0});
+        }
+
+        for (unsigned node{0};; node++) {
+            const auto list{readLine(root + "node/node" + S::to_string(node) + "/cpulist")};
+            if (list.empty()) break;
+            topology.numaNodes = node + 1;
+            for (const auto cpu : parseCpuList(list))
+                for (auto &info : topology.cpus) if (info.cpu == cpu) info.numaNode = node;
+        }
+        return topology;
+    }
+
+    [[nodiscard]] const CpuInfo *find(unsigned cpu) const {
+        const auto it{S::find_if(cpus.begin(), cpus.end(), [=](const auto &info) { return info.cpu == cpu; })};
+        return it == cpus.end() ? nullptr : &*it;
+    }
+
+    // CPUs to pin workers to, in worker order, spread round-robin over NUMA nodes.
+    [[nodiscard]] S::vector<CpuInfo> workerCpus(Placement placement) const {
+        S::vector<S::vector<CpuInfo>> perNode(numaNodes);
+        S::set<S::pair<unsigned, unsigned>> seenCores;
+        S::vector<CpuInfo> siblings;
+
+        for (const auto &info : cpus)
+            if (seenCores.insert({info.package, info.core}).second) perNode[info.numaNode].push_back(info);
+            else siblings.push_back(info);
+
+        S::vector<CpuInfo> res;
+        for (size_t i{0}; res.size() + siblings.size() < cpus.size(); i++)
+            for (const auto &node : perNode) if (i < node.size()) res.push_back(node[i]);
+
+        if (placement == Placement::AllThreads) res.insert(res.end(), siblings.begin(), siblings.end());
+        return res;
+    }
+
+    [[nodiscard]] S::vector<unsigned> nodeCpus(size_t node) const {
+        S::vector<unsigned> res;
+        for (const auto &info : cpus) if (info.numaNode == node) res.push_back(info.cpu);
+        return res;
+    }
+};
+
+// Restricts a thread to cpus; false when the kernel refuses, e.g. for CPUs outside the process's cpuset, and the
+// thread keeps its placement.
+#ifdef __linux__
+inline bool pinThread(pthread_t thread, const S::vector<unsigned> &cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto cpu : cpus) if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+#endif
+
+inline bool pinThread(S::thread &thread, const S::vector<unsigned> &cpus) {
+#ifdef __linux__
+    return pinThread(thread.native_handle(), cpus);
+#else
+    return false;
+#endif
+}
+
+inline bool pinCurrentThread(const S::vector<unsigned> &cpus) {
+#ifdef __linux__
+    return pinThread(pthread_self(), cpus);
+#else
+    return false;
+#endif
+}
+
+inline unsigned currentCpu() {
+#ifdef __linux__
+    const auto cpu{sched_getcpu()};
+    return cpu < 0 ? 0 : static_cast<unsigned>(cpu);
+#else
+    return 0;
+#endif
+}
+
+// One copy of a read-only object per NUMA node, each made by a thread pinned to its node.
+template<typename T>
+struct NumaReplicas {
+    S::vector<S::unique_ptr<const T>> replicas;
+
+    NumaReplicas(const T &source, const Topology &topology) : replicas(topology.numaNodes) {
+        for (size_t node{0}; node < topology.numaNodes; node++) {
+            S::thread([&, node]() {
+                pinCurrentThread(topology.nodeCpus(node));
+                replicas[node] = S::make_unique<const T>(source);
+            }).join();
+        }
+    }
+
+    [[nodiscard]] const T &local(size_t node) const { return *replicas[node < replicas.size() ? node : 0]; }
+};
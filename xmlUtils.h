@@ -39,4 +39,13 @@ auto getXmlNodes(const S::string &name) {
     const auto xmlNodes{doc->FirstChildElement("smile")->FirstChildElement("nodes")};
 
     return toVector(xmlNodes, "cpt");
-}
\ No newline at end of file
+}
+
+// The numsamples attribute of the <smile> element, SMILE's sample budget for the network; 0 when absent.
+size_t getNumSamples(const S::string &name) {
+    T::XMLDocument doc{};
+    doc.LoadFile(name.c_str());
+    unsigned numSamples{0};
+    doc.FirstChildElement("smile")->QueryUnsignedAttribute("numsamples", &numSamples);
+    return numSamples;
+}